@@ -1,14 +1,226 @@
 #include "fsdetect_impl.h"
 
+static const uint64_t plan_block_idxs[FSDETECT_PLAN_BLOCK_COUNT] =
+    FSDETECT_PLAN_BLOCK_IDXS;
+
+/* Without read_block_list, plan blocks closer than this (FAT_SB_BLOCK and
+ * EXT_SB_BLOCK) are read with a single call.
+ */
+#define PLAN_READ_SPAN 4
+
+struct AssertPlanStruct {
+   int AssertPlan : FAT_SB_BLOCK == NTFS_SB_BLOCK &&
+       FAT_SB_BLOCK < EXT_SB_BLOCK && EXT_SB_BLOCK < BTRFS_SB_BLOCK &&
+       FSDETECT_PLAN_BLOCK_COUNT > 0 &&
+       sizeof(plan_block_idxs) / sizeof(plan_block_idxs[0]) <=
+       FSDETECT_CACHE_SIZE &&
+       PLAN_READ_SPAN + 1 <= FSDETECT_CACHE_SIZE; };
+
+typedef int (*probe_t)(const struct fsdetect_reader *rd,
+                       struct fsdetect_output *fsdo);
+
+/* Probes not compiled in are NULL, and they are always filtered. */
+#if FSDETECT_ENABLED_FAT
+#define PROBE_FAT fsdetect_fat
+#else
+#define PROBE_FAT 0
+#endif
+#if FSDETECT_ENABLED_EXT
+#define PROBE_EXT fsdetect_ext
+#else
+#define PROBE_EXT 0
+#endif
+#if FSDETECT_ENABLED_NTFS
+#define PROBE_NTFS fsdetect_ntfs
+#else
+#define PROBE_NTFS 0
+#endif
+#if FSDETECT_ENABLED_BTRFS
+#define PROBE_BTRFS fsdetect_btrfs
+#else
+#define PROBE_BTRFS 0
+#endif
+
+struct probe_entry {
+  probe_t probe;
+  /* The other probes which can succeed on the same device. The rest have
+   * contradicting checks, so their relative order doesn't matter.
+   */
+  uint32_t conflict_mask;
+};
+
+/* The probe registry. If several probes succeed, the first one wins
+ * (precedence). Syslinux 4.07 ldlinux.lst has the filesystems in this
+ * order. The index in this array is the index in fsdetect_stats.probes.
+ */
+static const struct probe_entry probes[] = {
+    /* FAT needs 1 or 2 FATs, NTFS needs 0. */
+    { PROBE_FAT, FSDETECT_PROBE_EXT | FSDETECT_PROBE_BTRFS },
+    { PROBE_EXT, FSDETECT_PROBE_FAT | FSDETECT_PROBE_NTFS |
+                 FSDETECT_PROBE_BTRFS },
+    { PROBE_NTFS, FSDETECT_PROBE_EXT | FSDETECT_PROBE_BTRFS },
+    { PROBE_BTRFS, FSDETECT_PROBE_FAT | FSDETECT_PROBE_EXT |
+                   FSDETECT_PROBE_NTFS } };
+
+static const uint8_t precedence_order[FSDETECT_PROBE_COUNT] = { 0, 1, 2, 3 };
+
+struct AssertProbesStruct {
+   int AssertProbes : sizeof(probes) / sizeof(probes[0]) ==
+       FSDETECT_PROBE_COUNT && FSDETECT_PROBE_ALL ==
+       (1 << FSDETECT_PROBE_COUNT) - 1 && FSDETECT_PROBE_FAT == 1 &&
+       FSDETECT_PROBE_EXT == 2 && FSDETECT_PROBE_NTFS == 4 &&
+       FSDETECT_PROBE_BTRFS == 8; };
+
+/* Adapts a read_block_t to read_block64_t. */
+struct read_block_shim {
+  read_block_t read_block;
+  void *read_block_data;
+};
+
+static int read_block_shim(void *shim_ptr, uint64_t block_idx,
+                           uint32_t block_count, void *buf) {
+  const struct read_block_shim *shim = (const struct read_block_shim*)shim_ptr;
+  if (block_idx + block_count > (uint64_t)1 << 32) {
+    memset(buf, '\0', (size_t)block_count << 9);
+    return -1;
+  }
+  return shim->read_block(shim->read_block_data, block_idx, block_count, buf);
+}
+
 void fsdetect(read_block_t read_block, void *read_block_data,
               struct fsdetect_output *fsdo) {
+  struct fsdetect_args args;
+  memset(&args, '\0', sizeof(args));
+  args.read_block = read_block;
+  args.read_block_data = read_block_data;
+  fsdetect_ex(&args, fsdo);
+}
+
+void fsdetect64(read_block64_t read_block64, void *read_block_data,
+                struct fsdetect_output *fsdo) {
+  struct fsdetect_args args;
+  memset(&args, '\0', sizeof(args));
+  args.read_block64 = read_block64;
+  args.read_block_data = read_block_data;
+  fsdetect_ex(&args, fsdo);
+}
+
+void fsdetect_ex(const struct fsdetect_args *args,
+                 struct fsdetect_output *fsdo) {
+  struct fsdetect_cache cache;
+  struct read_block_shim shim;
+  struct fsdetect_reader rd;
+  struct fsdetect_probe_stats *probe_stats;
+  struct fsdetect_output out;
+  const uint8_t *order = args->probe_order ? args->probe_order :
+      precedence_order;
+  uint32_t mask = FSDETECT_PROBE_ENABLED, probe_idx, miss_count, i, j;
+  uint32_t need_mask;  /* Probes which can still change the result. */
+  int result, is_found = 0;
+  uint64_t start_ns;
+  unsigned char blocks[PLAN_READ_SPAN][512];
+  fsdetect_cache_init(&cache, 0, 0);  /* For the stats. */
+  rd.map_block = args->map_block;
+  rd.read_block = fsdetect_cache_read_block;
+  rd.data = &cache;
+  rd.stats = 0;
+  rd.scratch = (unsigned char*)args->scratch;
+  rd.scratch_size = args->scratch ? args->scratch_size : 0;
+  rd.flags = args->flags;
+  rd.btrfs_info = args->btrfs_info;
+  if (args->map_block) {
+    rd.data = args->read_block_data;  /* No need for a cache. */
+    mask = fsdetect_prefilter(
+        FSDETECT_ENABLED_FAT | FSDETECT_ENABLED_NTFS ? (const unsigned char*)
+            args->map_block(rd.data, FAT_SB_BLOCK, 1) : 0,
+        FSDETECT_ENABLED_EXT ? (const unsigned char*)
+            args->map_block(rd.data, EXT_SB_BLOCK, 1) : 0,
+        FSDETECT_ENABLED_BTRFS ? (const unsigned char*)
+            args->map_block(rd.data, BTRFS_SB_BLOCK, 1) : 0) &
+        FSDETECT_PROBE_ENABLED;
+  } else if (args->read_block64) {
+    fsdetect_cache_init(&cache, args->read_block64, args->read_block_data);
+  } else {
+    shim.read_block = args->read_block;
+    shim.read_block_data = args->read_block_data;
+    fsdetect_cache_init(&cache, read_block_shim, &shim);
+  }
+  if (!args->map_block) {
+    /* Without read_block_list, or if it fails (e.g. the device is shorter
+     * than BTRFS_SB_BLOCK), the plan blocks are read through the cache,
+     * nearby ones together, and one by one if that fails. A block which
+     * can't be read isn't cached, so the prefilter rejects the probes which
+     * need it (they would fail anyway).
+     */
+    if (!args->read_block_list || fsdetect_cache_read_block_list(
+        &cache, args->read_block_list, args->read_block_data, plan_block_idxs,
+        FSDETECT_PLAN_BLOCK_COUNT) != 0) {
+      for (i = 0; i < FSDETECT_PLAN_BLOCK_COUNT; i = j) {
+        for (j = i + 1; j < FSDETECT_PLAN_BLOCK_COUNT &&
+             plan_block_idxs[j] - plan_block_idxs[i] < PLAN_READ_SPAN; ++j) {}
+        if (fsdetect_cache_read_block(
+            &cache, plan_block_idxs[i],
+            (uint32_t)(plan_block_idxs[j - 1] - plan_block_idxs[i] + 1),
+            blocks) != 0) {
+          for (; i < j; ++i) {
+            (void)fsdetect_cache_read_block(&cache, plan_block_idxs[i], 1,
+                                            blocks);
+          }
+        }
+      }
+    }
+    mask = fsdetect_prefilter(fsdetect_cache_find(&cache, FAT_SB_BLOCK),
+                              fsdetect_cache_find(&cache, EXT_SB_BLOCK),
+                              fsdetect_cache_find(&cache, BTRFS_SB_BLOCK)) &
+        FSDETECT_PROBE_ENABLED;
+  }
+  FSDETECT_TRACE1(detect__start, mask);
   memset(fsdo, '\0', sizeof(*fsdo));
-  /* Syslinux 4.07 ldlinux.lst has the filesystems in this order. */
-  if (fsdetect_fat(read_block, read_block_data, fsdo) != 0 &&
-      fsdetect_ext(read_block, read_block_data, fsdo) != 0 &&
-      fsdetect_ntfs(read_block, read_block_data, fsdo) != 0 &&
-      fsdetect_btrfs(read_block, read_block_data, fsdo) != 0) {
+  if (args->stats) {
+    memset(args->stats, '\0', sizeof(*args->stats));
+    for (probe_idx = 0; probe_idx < FSDETECT_PROBE_COUNT; ++probe_idx) {
+      args->stats->probes[probe_idx].result = FSDETECT_RESULT_NOT_RUN;
+    }
+  }
+  /* Only the probes which passed the prefilter run, in order. After a
+   * success, only the probes which precede the winner and conflict with it
+   * still run, so the result is the same as in precedence order.
+   */
+  for (need_mask = mask, i = 0;
+       need_mask != 0 && i < FSDETECT_PROBE_COUNT; ++i) {
+    probe_idx = order[i];
+    if (!(mask & 1 << probe_idx)) {
+      if (args->stats) {
+        args->stats->probes[probe_idx].result = FSDETECT_RESULT_FILTERED;
+      }
+      continue;
+    }
+    if (!(need_mask & 1 << probe_idx)) continue;  /* Not run. */
+    need_mask &= ~(1U << probe_idx);
+    /* A failing probe may have filled some fields. */
+    memset(&out, '\0', sizeof(out));
+    FSDETECT_TRACE1(probe__start, fsdetect_probe_name(probe_idx));
+    if (args->stats) {
+      rd.stats = probe_stats = &args->stats->probes[probe_idx];
+      miss_count = cache.stats.miss_count;
+      start_ns = args->clock_ns ? args->clock_ns() : 0;
+      probe_stats->result = result = probes[probe_idx].probe(&rd, &out);
+      if (args->clock_ns) probe_stats->elapsed_ns = args->clock_ns() - start_ns;
+      probe_stats->miss_block_count = cache.stats.miss_count - miss_count;
+    } else {
+      result = probes[probe_idx].probe(&rd, &out);
+    }
+    FSDETECT_TRACE2(probe__done, fsdetect_probe_name(probe_idx), result);
+    if (result == 0) {
+      *fsdo = out;
+      is_found = 1;
+      need_mask &= ((1U << probe_idx) - 1) & probes[probe_idx].conflict_mask;
+    }
+  }
+  if (!is_found) {
     memset(fsdo, '\0', sizeof(*fsdo));
     fsdo->fstype[0] = '?';
   }
+  FSDETECT_TRACE1(detect__done, fsdo->fstype);
+  if (args->cache_stats) *args->cache_stats = cache.stats;
 }
@@ -14,11 +14,334 @@ struct fsdetect_output {
   uint8_t uuid[16];  /* Binary (not hex). */
 };
 
-/* Each block is 512 bytes. */
+/* Each block is 512 bytes. On error, fills buf with '\0' and returns
+ * nonzero.
+ */
+typedef int (*read_block64_t)(
+    void *fd_ptr, uint64_t block_idx, uint32_t block_count, void *buf);
+
+/* Old variant of read_block64_t, can address only the first 2 TiB. */
 typedef int (*read_block_t)(
     void *fd_ptr, uint32_t block_idx, uint32_t block_count, void *buf);
 
+/* Zero-copy alternative of read_block64_t: returns a pointer to
+ * block_count consecutive blocks starting at block_idx, or NULL on error.
+ * The data must remain valid and unchanged until fsdetect_ex returns.
+ */
+typedef const void *(*map_block_t)(
+    void *fd_ptr, uint64_t block_idx, uint32_t block_count);
+
+/* Reads the blocks block_idxs[0], ..., block_idxs[block_count - 1]
+ * (strictly increasing) to consecutive 512-byte slots of buf, preferably
+ * with a single vectored read (preadv). Returns nonzero on error.
+ */
+typedef int (*read_block_list_t)(
+    void *fd_ptr, const uint64_t *block_idxs, uint32_t block_count,
+    void *buf);
+
+/* Counters of the per-call block cache of fsdetect_ex. */
+struct fsdetect_cache_stats {
+  uint32_t hit_count;  /* Blocks served from the cache. */
+  uint32_t miss_count;  /* Blocks read by calling read_block. */
+};
+
+/* Number of probes, in the order fsdetect tries them: FAT, ext, NTFS,
+ * Btrfs.
+ */
+#define FSDETECT_PROBE_COUNT 4
+
+/* Special values of fsdetect_probe_stats.result. */
+#define FSDETECT_RESULT_NOT_RUN (-3)  /* An earlier probe has succeeded. */
+#define FSDETECT_RESULT_FILTERED (-2)  /* Rejected by the prefilter. */
+
+struct fsdetect_probe_stats {
+  /* 0 on success, otherwise the probe-specific rejection code (e.g. 10 for
+   * bad magic, -1 for a failed read), or FSDETECT_RESULT_*.
+   */
+  int result;
+  uint32_t read_count;  /* Number of reads (or maps) the probe made. */
+  /* Blocks read from read_block64 or read_block (cache misses). Blocks
+   * fetched for the prefilter before the probes run are not counted.
+   */
+  uint32_t miss_block_count;
+  uint64_t byte_count;  /* Total size of the reads the probe made. */
+  uint64_t elapsed_ns;  /* Time spent in the probe, including reads. */
+};
+
+struct fsdetect_stats {
+  struct fsdetect_probe_stats probes[FSDETECT_PROBE_COUNT];
+};
+
+/* fsdetect_stats_total.probes[i].result_counts[r + FSDETECT_RESULT_BIAS]
+ * counts result r of probe i. Results >= FSDETECT_RESULT_LIMIT are counted
+ * at FSDETECT_RESULT_LIMIT - 1.
+ */
+#define FSDETECT_RESULT_BIAS 3
+#define FSDETECT_RESULT_LIMIT 61
+
+/* Aggregated struct fsdetect_stats of many detections. */
+struct fsdetect_stats_total {
+  uint32_t detection_count;
+  struct fsdetect_probe_stats_total {
+    uint32_t run_count;  /* Number of times the probe function was called. */
+    uint32_t result_counts[FSDETECT_RESULT_BIAS + FSDETECT_RESULT_LIMIT];
+    uint64_t read_count;
+    uint64_t miss_block_count;
+    uint64_t byte_count;
+    uint64_t elapsed_ns;
+  } probes[FSDETECT_PROBE_COUNT];
+};
+
+/* Fields of a Btrfs superblock for assembling multi-device filesystems.
+ * The fsid is in fsdetect_output.uuid.
+ */
+struct fsdetect_btrfs_info {
+  uint64_t devid;  /* Usually 1 .. num_devices. */
+  uint64_t num_devices;
+  uint64_t generation;
+  uint8_t dev_uuid[16];
+  /* The superblock used: 0 is the primary at 64 KiB, 1 is the mirror at
+   * 64 MiB, 2 is the mirror at 256 GiB.
+   */
+  uint32_t sb_idx;
+};
+
+/* Returns a monotonic time in nanoseconds. */
+typedef uint64_t (*clock_ns_t)(void);
+
+struct fsdetect_args {
+  /* If not NULL, used instead of read_block64 and read_block, and the
+   * probes look at the returned data in place, without copying.
+   */
+  map_block_t map_block;
+  read_block64_t read_block64;  /* If NULL, read_block is used. */
+  read_block_t read_block;
+  void *read_block_data;
+  /* Can be NULL. If specified, the blocks each probe reads unconditionally
+   * are read with a single call to this before running the probes.
+   */
+  read_block_list_t read_block_list;
+  struct fsdetect_cache_stats *cache_stats;  /* Can be NULL. */
+  struct fsdetect_stats *stats;  /* Can be NULL. Per-probe output. */
+  /* Can be NULL, then fsdetect_probe_stats.elapsed_ns remains 0. The library
+   * doesn't read the clock itself, because xtiny has no clock_gettime.
+   */
+  clock_ns_t clock_ns;
+  /* Can be NULL. Scratch memory for the probes, for data larger than their
+   * stack buffers: with FSDETECT_SCRATCH_SIZE bytes, the NTFS probe
+   * supports MFT records up to 64 KiB, and reads records 0 to 3 with a
+   * single call. Without it, records up to 1 KiB are read with a single
+   * call, up to 4 KiB with two calls, and larger ones are rejected.
+   */
+  void *scratch;
+  uint32_t scratch_size;
+  uint32_t flags;  /* Bitwise or of FSDETECT_VERIFY_CSUM etc. */
+  /* Can be NULL. Filled if the result is Btrfs. */
+  struct fsdetect_btrfs_info *btrfs_info;
+  /* Can be NULL. A permutation of probe indexes (as in fsdetect_stats) to
+   * run the probes in, e.g. from fsdetect_probe_order. The result is the
+   * same as with NULL (precedence order), only the probes run differ.
+   */
+  const uint8_t *probe_order;
+};
+
+#define FSDETECT_SCRATCH_SIZE (4 * 65536)
+
+/* Verify the superblock checksum of ext4 (metadata_csum) and Btrfs
+ * (crc32c), and reject the filesystem on mismatch. Costs one more read of
+ * 512 (ext4) or 3584 (Btrfs) bytes.
+ */
+#define FSDETECT_VERIFY_CSUM 1
+/* Also read the Btrfs mirror superblocks at 64 MiB and 256 GiB (those
+ * within dev_item.total_bytes), and use the one with the highest
+ * generation. They are requested right after the primary one, but each
+ * with its own read_block64 call. Checksums of the mirrors are not
+ * verified.
+ */
+#define FSDETECT_BTRFS_MIRRORS 2
+
 void fsdetect(read_block_t read_block, void *read_block_data,
               struct fsdetect_output *fsdo);
 
+void fsdetect64(read_block64_t read_block64, void *read_block_data,
+                struct fsdetect_output *fsdo);
+
+/* Like fsdetect, but with more inputs and outputs in args. Unused fields
+ * of args must be 0. The probes share a small block cache in front of
+ * args->read_block64 (or args->read_block).
+ *
+ * All functions of the library are reentrant: they keep their state
+ * (block cache, scratch) on the stack or in args, so many threads may
+ * detect at the same time, even on the same device, if the callbacks are
+ * thread-safe (e.g. fsdetect_fd_read_block, but only in the full build)
+ * and each thread has its own args->scratch, stats and outputs.
+ */
+void fsdetect_ex(const struct fsdetect_args *args,
+                 struct fsdetect_output *fsdo);
+
+struct fsdetect_partition {
+  uint64_t start_block;  /* In 512-byte blocks, from the start of the disk. */
+  uint64_t block_count;
+  /* 1 .. 4 for MBR primary, 5 .. for MBR logical partitions, the index + 1
+   * in the partition entry array for GPT. As in /dev/sda<number> on Linux.
+   */
+  uint32_t number;
+  uint8_t mbr_type;  /* MBR partition type, 0xee for GPT partitions. */
+  struct fsdetect_output fsdo;  /* The filesystem in the partition. */
+};
+
+/* Parses the MBR (including the chain of logical partitions) or GPT
+ * partition table on the whole-disk device args describes, and detects the
+ * filesystem in each partition, using an offset-translating adapter around
+ * the read callbacks of args. With read_block_list, the superblocks of
+ * several partitions are read with a single call. A GPT with a bad CRC is
+ * ignored, then the backup GPT is tried. args->stats is summed over the
+ * partitions (a probe's result is 0 if it succeeded in any of them),
+ * args->btrfs_info is filled from the last Btrfs partition, and
+ * args->cache_stats is ignored.
+ *
+ * Fills parts with the first max_count partitions (in partition table
+ * order), and returns their number. Returns -1 if block 0 is not a
+ * partition table (e.g. it's the boot sector of a FAT filesystem), then
+ * the caller may try fsdetect_ex on the whole device.
+ */
+int fsdetect_partitions(const struct fsdetect_args *args,
+                        struct fsdetect_partition *parts,
+                        uint32_t max_count);
+
+/* Like fsdetect_ex, but detects the filesystem starting at start_block,
+ * which is block_count blocks long. args->stats and args->cache_stats are
+ * ignored.
+ */
+void fsdetect_at(const struct fsdetect_args *args, uint64_t start_block,
+                 uint64_t block_count, struct fsdetect_output *fsdo);
+
+/* A possible filesystem start found by fsdetect_carve. */
+struct fsdetect_candidate {
+  uint64_t start_block;
+  uint32_t probe_mask;  /* The probes whose signature matched. */
+};
+
+/* Scans block_count consecutive blocks (the first one is first_block_idx
+ * on the device) for the signatures the probes look for first: FAT and
+ * NTFS boot sectors, the ext superblock magic (2 blocks after the start)
+ * and the Btrfs superblock magic (128 blocks after the start). Writes the
+ * possible filesystem starts to candidates (at most 3 * block_count of
+ * them, starts before block 0 are omitted), and returns their number.
+ * Verify the candidates with fsdetect_at.
+ */
+uint32_t fsdetect_carve(const void *blocks, uint32_t block_count,
+                        uint64_t first_block_idx,
+                        struct fsdetect_candidate *candidates);
+
+/* A hash of the superblock fields identifying a detected filesystem and
+ * its last change (e.g. the ext s_wtime, the Btrfs generation, the FAT and
+ * NTFS serial), for revalidating a cached fsdetect_output.
+ */
+struct fsdetect_fingerprint {
+  uint64_t block_idx;  /* First block the fingerprint covers. */
+  uint32_t block_count;  /* 0 if there is no fingerprint. */
+  uint32_t reserved;
+  uint64_t hash;
+};
+
+/* Computes the fingerprint of fsdo, which fsdetect_ex has just returned
+ * for the device args describes. Returns nonzero (and sets
+ * fp->block_count to 0) if fsdo has no fingerprint (e.g. fstype "?") or on
+ * read error.
+ */
+int fsdetect_fingerprint(const struct fsdetect_args *args,
+                         const struct fsdetect_output *fsdo,
+                         struct fsdetect_fingerprint *fp);
+
+/* Reads only the blocks of fp (1 or 2 blocks, with a single read call),
+ * and returns 0 if they still match, i.e. the cached fsdo is still valid.
+ * Otherwise returns nonzero, then call fsdetect_ex. Doesn't notice a
+ * changed NTFS label (it's in the MFT).
+ */
+int fsdetect_revalidate(const struct fsdetect_args *args,
+                        const struct fsdetect_output *fsdo,
+                        const struct fsdetect_fingerprint *fp);
+
+/* A range of blocks fsdetect_async_step needs. The caller fills result
+ * and data.
+ */
+struct fsdetect_range {
+  uint64_t block_idx;
+  uint32_t block_count;
+  int result;  /* 0 if data is valid, nonzero on read error. */
+  /* block_count * 512 bytes, must remain valid and unchanged until the last
+   * fsdetect_async_step call.
+   */
+  const void *data;
+};
+
+#define FSDETECT_ASYNC_RANGE_COUNT 16
+
+/* State of a non-blocking detection, see fsdetect_async_step. */
+struct fsdetect_async {
+  struct fsdetect_args args;
+  uint32_t range_count;
+  uint32_t supplied_count;  /* ranges[0 .. supplied_count - 1] are filled. */
+  struct fsdetect_range ranges[FSDETECT_ASYNC_RANGE_COUNT];
+};
+
+/* Starts a non-blocking detection with the fields of args other than the
+ * read callbacks (scratch, flags, stats etc.), which are ignored.
+ */
+void fsdetect_async_init(struct fsdetect_async *fa,
+                         const struct fsdetect_args *args);
+
+/* Runs the probes on the ranges supplied so far. Returns 0 if the
+ * detection is complete, then fsdo is the result. Otherwise returns n > 0,
+ * and the last n of fa->ranges[0 .. fa->range_count - 1] are the new
+ * ranges needed: fetch them (all at once, e.g. over the network), fill
+ * their result and data, and call this again. A missing block fails a
+ * read, so all probes issue their next read in the same step: usually 2
+ * steps (the superblocks, then the NTFS MFT, the Btrfs checksummed area
+ * etc.) are enough. After FSDETECT_ASYNC_RANGE_COUNT ranges further
+ * missing blocks count as read errors.
+ */
+uint32_t fsdetect_async_step(struct fsdetect_async *fa,
+                             struct fsdetect_output *fsdo);
+
+/* Returns the CRC32C of data, continuing from crc. No inversion before or
+ * after: pass ~0 as crc and invert the result for the usual CRC32C. Uses
+ * the SSE4.2 crc32 instruction if the CPU has it.
+ */
+uint32_t fsdetect_crc32c(uint32_t crc, const void *data, uint32_t size);
+
+/* Same as fsdetect_crc32c, but always with the portable table version. */
+uint32_t fsdetect_crc32c_table(uint32_t crc, const void *data, uint32_t size);
+
+/* A read_block64_t reading from a file descriptor, pass (void*)(size_t)fd
+ * as data. Uses pread, which doesn't move the file offset, so threads can
+ * share fd. In the xtiny and tcc builds it uses lseek and read instead:
+ * not reentrant there, and offsets are limited to 2 GiB.
+ */
+int fsdetect_fd_read_block(void *fd_ptr, uint64_t block_idx,
+                           uint32_t block_count, void *buf);
+
+#if !defined(__XTINY__) && !defined(__TINYC__)
+/* A read_block_list_t for fsdetect_fd_read_block, with a single preadv
+ * call per group of nearby blocks. Not in the xtiny and tcc builds.
+ */
+int fsdetect_fd_read_block_list(void *fd_ptr, const uint64_t *block_idxs,
+                                uint32_t block_count, void *buf);
+#endif
+
+/* Returns the name of probe probe_idx, e.g. "fat" for 0. */
+const char *fsdetect_probe_name(uint32_t probe_idx);
+
+/* Adds the stats of a detection to total. Clear total with memset first. */
+void fsdetect_stats_add(struct fsdetect_stats_total *total,
+                        const struct fsdetect_stats *stats);
+
+/* Computes a probe order for fsdetect_args.probe_order from the stats of
+ * previous detections: by increasing elapsed_ns per success (cost divided
+ * by hit rate). Probes without a success go last, in precedence order.
+ */
+void fsdetect_probe_order(const struct fsdetect_stats_total *total,
+                          uint8_t *order);
+
 #endif /* _FSDETECT_H */
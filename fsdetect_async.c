@@ -0,0 +1,72 @@
+#include "fsdetect_impl.h"
+
+/* fsdetect_async_step replays fsdetect_ex from the start in each step,
+ * with this map_block_t serving the supplied ranges. Probes are cheap
+ * compared to a round trip, and they need no changes this way.
+ */
+static const void *async_map_block(void *fa_ptr, uint64_t block_idx,
+                                   uint32_t block_count) {
+  struct fsdetect_async *fa = (struct fsdetect_async*)fa_ptr;
+  struct fsdetect_range *r;
+  uint64_t end_idx;
+  uint32_t i;
+  char is_error = 0;
+  for (i = 0; i < fa->supplied_count; ++i) {
+    r = fa->ranges + i;
+    if (block_idx >= r->block_idx && block_count <= r->block_count &&
+        block_idx - r->block_idx <= r->block_count - block_count) {
+      if (r->result != 0 || !r->data) {
+        is_error = 1;  /* Maybe another range has it. */
+      } else {
+        return (const unsigned char*)r->data +
+            ((block_idx - r->block_idx) << 9);
+      }
+    }
+  }
+  if (is_error) return 0;
+  /* Missing: merge it to an overlapping or adjacent new range, or add a
+   * new range.
+   */
+  end_idx = block_idx + block_count;
+  for (; i < fa->range_count; ++i) {
+    r = fa->ranges + i;
+    if (block_idx <= r->block_idx + r->block_count && r->block_idx <= end_idx) {
+      if (end_idx < r->block_idx + r->block_count) {
+        end_idx = r->block_idx + r->block_count;
+      }
+      if (block_idx > r->block_idx) block_idx = r->block_idx;
+      if (end_idx - block_idx <= 0xffffffffU) {
+        r->block_idx = block_idx;
+        r->block_count = (uint32_t)(end_idx - block_idx);
+        return 0;
+      }
+    }
+  }
+  if (fa->range_count < FSDETECT_ASYNC_RANGE_COUNT) {
+    r = fa->ranges + fa->range_count++;
+    r->block_idx = block_idx;
+    r->block_count = block_count;
+    r->result = 0;
+    r->data = 0;
+  }
+  return 0;
+}
+
+void fsdetect_async_init(struct fsdetect_async *fa,
+                         const struct fsdetect_args *args) {
+  memset(fa, '\0', sizeof(*fa));
+  fa->args = *args;
+  fa->args.read_block64 = 0;
+  fa->args.read_block = 0;
+  fa->args.read_block_list = 0;
+}
+
+uint32_t fsdetect_async_step(struct fsdetect_async *fa,
+                             struct fsdetect_output *fsdo) {
+  struct fsdetect_args args = fa->args;
+  fa->supplied_count = fa->range_count;
+  args.map_block = async_map_block;
+  args.read_block_data = fa;
+  fsdetect_ex(&args, fsdo);
+  return fa->range_count - fa->supplied_count;
+}
@@ -0,0 +1,269 @@
+#include "fsdetect_tool.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct batch {
+  struct batch_item *items;
+  uint32_t item_count;
+  uint32_t next_idx;  /* Next item to be picked up by a worker. */
+  uint32_t thread_count;  /* Number of running worker threads. */
+  uint32_t flags;
+  /* Adaptive probe order, guarded by mutex. Recomputed from the stats of
+   * all detections so far, after every PROBE_ORDER_INTERVAL of them.
+   */
+  uint8_t probe_order[FSDETECT_PROBE_COUNT];
+  struct fsdetect_stats_total probe_total;
+  pthread_mutex_t mutex;
+  pthread_cond_t done_cond;
+  /* Used by batch_wait_item without threads. Can be NULL. */
+  unsigned char *direct_pool;
+  void *scratch;
+  pthread_t threads[1];  /* Actually thread_count. */
+};
+
+#define PROBE_ORDER_INTERVAL 32
+
+uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Uses the result in item->cache_entry if the device hasn't changed since,
+ * reading only its fingerprint blocks. Otherwise detects and updates it.
+ */
+static void detect_cached(struct batch_item *item,
+                          const struct fsdetect_args *args, int fd) {
+  struct rcache_entry *e = item->cache_entry;
+  struct rcache_key key;
+  if (rcache_get_key(fd, &key) != 0) {
+    e->is_valid = 0;
+    fsdetect_ex(args, &item->fsdo);
+    return;
+  }
+  if (e->is_valid && 0 == memcmp(&key, &e->key, sizeof(key)) &&
+      fsdetect_revalidate(args, &e->fsdo, &e->fp) == 0) {
+    item->fsdo = e->fsdo;
+    return;
+  }
+  fsdetect_ex(args, &item->fsdo);
+  e->key = key;
+  e->fsdo = item->fsdo;
+  /* Results without a fingerprint (e.g. "?") are not cached. */
+  e->is_valid = fsdetect_fingerprint(args, &item->fsdo, &e->fp) == 0;
+}
+
+/* Doesn't call malloc (except for BATCH_PARTITIONS). The block cache of
+ * fsdetect_ex is on the stack of the worker thread. scratch (for the
+ * probes, FSDETECT_SCRATCH_SIZE bytes) is allocated once per thread, it
+ * would overflow small thread stacks (e.g. 128 KiB on musl). Can be NULL.
+ */
+static void detect_item(struct batch_item *item, uint32_t flags,
+                        const uint8_t *probe_order,
+                        struct fsdetect_stats *stats,
+                        unsigned char *direct_pool, void *scratch) {
+  struct fsdetect_args args;
+  struct mmap_file mf;
+  struct qcow2_image qi;
+#ifdef HAVE_DIRECT
+  struct direct_reader dr;
+#endif
+  int fd = -1;
+  int part_count;
+  uint32_t probe_idx;
+  item->parts = 0;
+  /* Remains like this if fsdetect_ex doesn't run. */
+  memset(stats, '\0', sizeof(*stats));
+  for (probe_idx = 0; probe_idx < FSDETECT_PROBE_COUNT; ++probe_idx) {
+    stats->probes[probe_idx].result = FSDETECT_RESULT_NOT_RUN;
+  }
+#ifdef HAVE_DIRECT
+  if (direct_pool) fd = direct_open(item->path);
+#endif
+  /* Without a pool, or if the filesystem doesn't support O_DIRECT. */
+  if (fd < 0) {
+    direct_pool = 0;
+    fd = open(item->path, O_RDONLY);
+  }
+  item->is_open_failed = fd < 0;
+  if (fd < 0) {
+    memset(&item->fsdo, '\0', sizeof(item->fsdo));
+    item->fsdo.fstype[0] = '?';
+    return;
+  }
+  memset(&args, '\0', sizeof(args));
+  args.read_block64 = fsdetect_fd_read_block;  /* Only this thread uses fd. */
+  args.read_block_data = (void*)(size_t)fd;
+  args.read_block_list = fsdetect_fd_read_block_list;
+  args.stats = stats;
+  args.clock_ns = monotonic_ns;
+  args.probe_order = probe_order;
+  args.scratch = scratch;
+  args.scratch_size = FSDETECT_SCRATCH_SIZE;
+  if (flags & BATCH_VERIFY_CSUM) args.flags |= FSDETECT_VERIFY_CSUM;
+  if (flags & BATCH_BTRFS_MIRRORS) args.flags |= FSDETECT_BTRFS_MIRRORS;
+  args.btrfs_info = item->btrfs_info;
+#ifdef HAVE_DIRECT
+  if (direct_pool) {  /* No qcow2 or mmap: they don't read aligned. */
+    direct_init(&dr, fd, direct_pool);
+    args.read_block64 = direct_read_block;
+    args.read_block_data = &dr;
+    args.read_block_list = 0;
+    flags &= ~BATCH_MMAP;
+  } else
+#endif
+  if (qcow2_open(&qi, fd, item->path) == 0) {
+    args.read_block64 = qcow2_read_block;
+    args.read_block_data = &qi;
+    args.read_block_list = 0;
+    flags = (flags & ~BATCH_MMAP) | BATCH_QCOW2;
+  } else if ((flags & BATCH_MMAP) && mmap_file_open(&mf, fd) == 0) {
+    args.map_block = mmap_map_block;
+    args.read_block_data = &mf;
+  } else {
+    flags &= ~BATCH_MMAP;
+  }
+  if ((flags & BATCH_PARTITIONS) && (item->parts = (struct fsdetect_partition*)
+      malloc(BATCH_MAX_PARTITIONS * sizeof(*item->parts))) != 0) {
+    if ((part_count = fsdetect_partitions(&args, item->parts,
+                                          BATCH_MAX_PARTITIONS)) > 0) {
+      item->part_count = part_count;
+    } else {  /* No partition table, or it's empty. */
+      free(item->parts);
+      item->parts = 0;
+    }
+  }
+  if (item->parts) {
+    /* Detected in each partition. */
+  } else if (item->cache_entry) {
+    detect_cached(item, &args, fd);
+  } else {
+    fsdetect_ex(&args, &item->fsdo);
+  }
+  if (flags & BATCH_MMAP) mmap_file_close(&mf);
+  if (flags & BATCH_QCOW2) qcow2_close(&qi);
+  close(fd);
+}
+
+/* Called with batch->mutex held, after each item. */
+static void add_item_stats(struct batch *batch, struct batch_item *item,
+                           const struct fsdetect_stats *stats) {
+  if (item->stats) *item->stats = *stats;
+  fsdetect_stats_add(&batch->probe_total, stats);
+  if (batch->probe_total.detection_count % PROBE_ORDER_INTERVAL == 0) {
+    fsdetect_probe_order(&batch->probe_total, batch->probe_order);
+  }
+}
+
+/* Returns a pool for detect_item, or NULL if it's not needed (or on out of
+ * memory, then detect_item doesn't use O_DIRECT).
+ */
+static unsigned char *batch_direct_pool(uint32_t flags) {
+#ifdef HAVE_DIRECT
+  if (flags & BATCH_DIRECT) return direct_pool_alloc();
+#else
+  (void)flags;
+#endif
+  return 0;
+}
+
+static void *worker(void *batch_ptr) {
+  struct batch *batch = (struct batch*)batch_ptr;
+  struct fsdetect_stats stats;
+  uint8_t probe_order[FSDETECT_PROBE_COUNT];
+  uint32_t item_idx;
+  /* Each thread has its own aligned buffers. */
+  unsigned char *direct_pool = batch_direct_pool(batch->flags);
+  void *scratch = malloc(FSDETECT_SCRATCH_SIZE);
+  for (;;) {
+    pthread_mutex_lock(&batch->mutex);
+    for (item_idx = batch->next_idx; item_idx < batch->item_count &&
+         batch->items[item_idx].is_done; ++item_idx) {}
+    batch->next_idx = item_idx + (item_idx < batch->item_count);
+    memcpy(probe_order, batch->probe_order, sizeof(probe_order));
+    pthread_mutex_unlock(&batch->mutex);
+    if (item_idx >= batch->item_count) break;
+    detect_item(batch->items + item_idx, batch->flags, probe_order, &stats,
+                direct_pool, scratch);
+    pthread_mutex_lock(&batch->mutex);
+    add_item_stats(batch, batch->items + item_idx, &stats);
+    batch->items[item_idx].is_done = 1;
+    pthread_cond_broadcast(&batch->done_cond);
+    pthread_mutex_unlock(&batch->mutex);
+  }
+  free(scratch);
+  free(direct_pool);
+  return 0;
+}
+
+struct batch *batch_start(struct batch_item *items, uint32_t item_count,
+                          uint32_t thread_count, uint32_t flags) {
+  struct batch *batch;
+  uint32_t i;
+  if (thread_count > item_count) thread_count = item_count;
+  if (thread_count <= 1) thread_count = 0;
+  batch = (struct batch*)malloc(
+      sizeof(*batch) + (thread_count + !thread_count - 1) * sizeof(pthread_t));
+  if (!batch) return 0;
+  batch->items = items;
+  batch->item_count = item_count;
+  batch->next_idx = 0;
+  batch->flags = flags;
+  batch->direct_pool = 0;
+  batch->scratch = 0;
+  memset(&batch->probe_total, '\0', sizeof(batch->probe_total));
+  for (i = 0; i < FSDETECT_PROBE_COUNT; ++i) {
+    batch->probe_order[i] = (uint8_t)i;  /* Precedence order. */
+  }
+  pthread_mutex_init(&batch->mutex, 0);
+  pthread_cond_init(&batch->done_cond, 0);
+  for (i = 0; i < thread_count; ++i) {
+    /* If it fails, run with fewer threads, or in batch_wait_item. */
+    if (pthread_create(batch->threads + i, 0, worker, batch) != 0) break;
+  }
+  batch->thread_count = i;
+  return batch;
+}
+
+void batch_wait_item(struct batch *batch, uint32_t item_idx) {
+  struct batch_item *item = batch->items + item_idx;
+  struct fsdetect_stats stats;
+  if (batch->thread_count == 0) {
+    if (!item->is_done) {
+      if (!batch->direct_pool) {
+        batch->direct_pool = batch_direct_pool(batch->flags);
+      }
+      if (!batch->scratch) batch->scratch = malloc(FSDETECT_SCRATCH_SIZE);
+      detect_item(item, batch->flags, batch->probe_order, &stats,
+                  batch->direct_pool, batch->scratch);
+      add_item_stats(batch, item, &stats);
+      item->is_done = 1;
+    }
+    return;
+  }
+  pthread_mutex_lock(&batch->mutex);
+  while (!item->is_done) {
+    pthread_cond_wait(&batch->done_cond, &batch->mutex);
+  }
+  pthread_mutex_unlock(&batch->mutex);
+}
+
+void batch_cancel(struct batch *batch) {
+  pthread_mutex_lock(&batch->mutex);
+  batch->next_idx = batch->item_count;
+  pthread_mutex_unlock(&batch->mutex);
+}
+
+void batch_finish(struct batch *batch) {
+  uint32_t i;
+  for (i = 0; i < batch->thread_count; ++i) {
+    pthread_join(batch->threads[i], 0);
+  }
+  pthread_cond_destroy(&batch->done_cond);
+  pthread_mutex_destroy(&batch->mutex);
+  free(batch->scratch);
+  free(batch->direct_pool);
+  free(batch);
+}
@@ -0,0 +1,411 @@
+/* Benchmark of fsdetect on an in-memory corpus of synthetic images.
+ *
+ * Usage: fsdetect_bench [<iterations>]
+ *    or: fsdetect_bench -t <threads> [<iterations>]
+ *    or: fsdetect_bench -l <latency_us> [<iterations>]
+ *
+ * For each image and each way of reading (read: read_block64 only, plan:
+ * with read_block_list, map: map_block), reports the time per detection,
+ * and the number of read callback calls and bytes read per detection.
+ * Exits with failure if any image is detected incorrectly. Then reports
+ * the speed of CRC32C (fsdetect_crc32c vs. fsdetect_crc32c_table) on a
+ * 4 KiB Btrfs superblock sized buffer.
+ *
+ * With -t, runs a stress test of reentrancy instead: writes the images to
+ * a single temporary file, then <threads> threads detect each image
+ * <iterations> times with fsdetect_at and fsdetect_fd_read_block on the
+ * shared descriptor, and also compare fsdetect_fd_read_block_list with
+ * the image data. Exits with failure on any mismatch.
+ *
+ * With -l, simulates a high-latency backend (e.g. network block storage),
+ * where each read_block call or each fsdetect_async_step round (all its
+ * ranges in flight at once) costs <latency_us>, and reports the number of
+ * round trips and the time per detection with the blocking read, plan and
+ * the async API.
+ */
+
+#define _DEFAULT_SOURCE 1  /* For clock_gettime, nanosleep and pread. */
+#define _FILE_OFFSET_BITS 64  /* The temporary file is larger than 2 GiB. */
+#include "fsdetect_corpus.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct counting_image {
+  struct corpus_image *image;
+  uint32_t read_count;
+  uint64_t byte_count;
+};
+
+static int counting_read_block(void *ci_ptr, uint64_t block_idx,
+                               uint32_t block_count, void *buf) {
+  struct counting_image *ci = (struct counting_image*)ci_ptr;
+  ++ci->read_count;
+  ci->byte_count += (uint64_t)block_count << 9;
+  return corpus_read_block(ci->image, block_idx, block_count, buf);
+}
+
+static int counting_read_block_list(void *ci_ptr, const uint64_t *block_idxs,
+                                    uint32_t block_count, void *buf) {
+  struct counting_image *ci = (struct counting_image*)ci_ptr;
+  ++ci->read_count;
+  ci->byte_count += (uint64_t)block_count << 9;
+  return corpus_read_block_list(ci->image, block_idxs, block_count, buf);
+}
+
+static const void *counting_map_block(void *ci_ptr, uint64_t block_idx,
+                                      uint32_t block_count) {
+  struct counting_image *ci = (struct counting_image*)ci_ptr;
+  ++ci->read_count;
+  ci->byte_count += (uint64_t)block_count << 9;
+  return corpus_map_block(ci->image, block_idx, block_count);
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define MODE_READ 0
+#define MODE_PLAN 1
+#define MODE_MAP 2
+
+static const char *const mode_names[] = { "read", "plan", "map" };
+
+/* Returns nonzero on detection mismatch. */
+static int bench_image(struct corpus_image *image, int mode,
+                       uint32_t iterations) {
+  struct counting_image ci;
+  struct fsdetect_args args;
+  struct fsdetect_output fsdo;
+  uint32_t i;
+  double start_ns, elapsed_ns;
+  ci.image = image;
+  ci.read_count = 0;
+  ci.byte_count = 0;
+  memset(&args, '\0', sizeof(args));
+  args.read_block64 = counting_read_block;
+  args.read_block_data = &ci;
+  if (mode == MODE_PLAN) args.read_block_list = counting_read_block_list;
+  if (mode == MODE_MAP) args.map_block = counting_map_block;
+  start_ns = now_ns();
+  for (i = 0; i < iterations; ++i) {
+    fsdetect_ex(&args, &fsdo);
+  }
+  elapsed_ns = now_ns() - start_ns;
+  printf("%-6s %-4s %10.1f %8.2f %10.1f %s\n", image->name, mode_names[mode],
+         elapsed_ns / iterations, (double)ci.read_count / iterations,
+         (double)ci.byte_count / iterations, fsdo.fstype);
+  if (0 != strcmp(fsdo.fstype, image->fstype)) {
+    fprintf(stderr, "fatal: %s detected as %s, expected %s\n",
+            image->name, fsdo.fstype, image->fstype);
+    return 1;
+  }
+  return 0;
+}
+
+typedef uint32_t (*crc32c_t)(uint32_t crc, const void *data, uint32_t size);
+
+/* Returns nonzero if the result is different from the table version. */
+static int bench_crc32c(const char *name, crc32c_t crc32c,
+                        uint32_t iterations) {
+  static unsigned char buf[4096];
+  uint32_t i, crc = 0;
+  double start_ns, elapsed_ns;
+  for (i = 0; i < sizeof(buf); ++i) {
+    buf[i] = (unsigned char)(i * 7 + (i >> 8));
+  }
+  start_ns = now_ns();
+  for (i = 0; i < iterations; ++i) {
+    crc = crc32c(crc, buf, sizeof(buf));  /* Chained, can't be skipped. */
+  }
+  elapsed_ns = now_ns() - start_ns;
+  printf("crc32c %-5s %10.1f ns/4KiB %8.2f GB/s\n", name,
+         elapsed_ns / iterations,
+         (double)sizeof(buf) * iterations / elapsed_ns);
+  if (fsdetect_crc32c_table(~(uint32_t)0, buf, sizeof(buf)) !=
+      crc32c(~(uint32_t)0, buf, sizeof(buf))) {
+    fprintf(stderr, "fatal: crc32c %s mismatch\n", name);
+    return 1;
+  }
+  return 0;
+}
+
+struct stress {
+  struct corpus_image *images;
+  uint32_t image_count;
+  uint64_t slot_block_count;  /* Image i starts at block i * this. */
+  int fd;
+  uint32_t iterations;
+  pthread_mutex_t mutex;
+  uint32_t mismatch_count;  /* Protected by mutex. */
+};
+
+struct stress_worker {
+  pthread_t thread;
+  struct stress *stress;
+  uint32_t image_idx;  /* Threads start at different images. */
+};
+
+/* Blocks of an image compared by stress_thread after each detection. */
+static const uint32_t stress_block_idxs[] = { 0, 1, 2, 3, 4, 128, 129 };
+#define STRESS_BLOCK_COUNT \
+    (sizeof(stress_block_idxs) / sizeof(stress_block_idxs[0]))
+
+static void *stress_thread(void *worker_ptr) {
+  struct stress_worker *worker = (struct stress_worker*)worker_ptr;
+  struct stress *stress = worker->stress;
+  struct corpus_image *image;
+  struct fsdetect_args args;
+  struct fsdetect_output fsdo;
+  /* Not on the stack: it's larger than the default thread stack on musl. */
+  void *scratch = malloc(FSDETECT_SCRATCH_SIZE);
+  unsigned char got[STRESS_BLOCK_COUNT][512];
+  unsigned char expected[STRESS_BLOCK_COUNT][512];
+  uint64_t block_idxs[STRESS_BLOCK_COUNT];
+  uint32_t i, j, mismatch_count = 0;
+  uint32_t image_idx = worker->image_idx;
+  memset(&args, '\0', sizeof(args));
+  args.read_block64 = fsdetect_fd_read_block;
+  args.read_block_data = (void*)(size_t)stress->fd;
+  args.scratch = scratch;  /* Can be NULL. */
+  args.scratch_size = FSDETECT_SCRATCH_SIZE;
+  for (i = 0; i < stress->iterations * stress->image_count; ++i) {
+    image = stress->images + (image_idx = (image_idx + 1) % stress->image_count);
+    fsdetect_at(&args, image_idx * stress->slot_block_count,
+                image->block_count, &fsdo);
+    if (0 != strcmp(fsdo.fstype, image->fstype)) {
+      fprintf(stderr, "fatal: %s detected as %s, expected %s\n",
+              image->name, fsdo.fstype, image->fstype);
+      ++mismatch_count;
+    }
+    for (j = 0; j < STRESS_BLOCK_COUNT; ++j) {
+      block_idxs[j] = image_idx * stress->slot_block_count +
+          stress_block_idxs[j];
+      corpus_read_block(image, stress_block_idxs[j], 1, expected[j]);
+    }
+    if (fsdetect_fd_read_block_list((void*)(size_t)stress->fd, block_idxs,
+                                    STRESS_BLOCK_COUNT, got) != 0 ||
+        0 != memcmp(got, expected, sizeof(got))) {
+      fprintf(stderr, "fatal: %s read_block_list mismatch\n", image->name);
+      ++mismatch_count;
+    }
+  }
+  pthread_mutex_lock(&stress->mutex);
+  stress->mismatch_count += mismatch_count;
+  pthread_mutex_unlock(&stress->mutex);
+  free(scratch);
+  return 0;
+}
+
+/* Returns the exit code. */
+static int run_stress(struct corpus_image *images, uint32_t image_count,
+                      uint32_t thread_count, uint32_t iterations) {
+  struct stress stress;
+  struct stress_worker *workers;
+  FILE *f;
+  uint32_t i, started_count;
+  double start_ns, elapsed_ns;
+  stress.images = images;
+  stress.image_count = image_count;
+  stress.iterations = iterations;
+  stress.mismatch_count = 0;
+  stress.slot_block_count = 0;
+  for (i = 0; i < image_count; ++i) {
+    if (stress.slot_block_count < images[i].block_count) {
+      stress.slot_block_count = images[i].block_count;
+    }
+  }
+  if (!(f = tmpfile())) {
+    fprintf(stderr, "fatal: tmpfile failed\n");
+    return 2;
+  }
+  stress.fd = fileno(f);
+  /* Sparse, the rest of each image reads as zeros, like in the corpus. */
+  if (ftruncate(stress.fd, (off_t)(image_count * stress.slot_block_count) << 9
+               ) != 0) {
+    fprintf(stderr, "fatal: ftruncate failed\n");
+    return 2;
+  }
+  for (i = 0; i < image_count; ++i) {
+    if (pwrite(stress.fd, images[i].data, sizeof(images[i].data),
+               (off_t)(i * stress.slot_block_count) << 9) !=
+        (ssize_t)sizeof(images[i].data)) {
+      fprintf(stderr, "fatal: pwrite failed\n");
+      return 2;
+    }
+  }
+  if (!(workers = (struct stress_worker*)malloc(
+      thread_count * sizeof(*workers)))) {
+    fprintf(stderr, "fatal: out of memory\n");
+    return 2;
+  }
+  pthread_mutex_init(&stress.mutex, 0);
+  start_ns = now_ns();
+  for (started_count = 0; started_count < thread_count; ++started_count) {
+    workers[started_count].stress = &stress;
+    workers[started_count].image_idx = started_count % image_count;
+    if (pthread_create(&workers[started_count].thread, 0, stress_thread,
+                       workers + started_count) != 0) break;
+  }
+  for (i = 0; i < started_count; ++i) {
+    pthread_join(workers[i].thread, 0);
+  }
+  elapsed_ns = now_ns() - start_ns;
+  pthread_mutex_destroy(&stress.mutex);
+  free(workers);
+  fclose(f);
+  printf("stress threads=%lu detections=%lu mismatches=%lu %.1f ns/detect\n",
+         (unsigned long)started_count,
+         (unsigned long)started_count * iterations * image_count,
+         (unsigned long)stress.mismatch_count,
+         elapsed_ns / ((double)started_count * iterations * image_count));
+  if (started_count == 0) {
+    fprintf(stderr, "fatal: pthread_create failed\n");
+    return 2;
+  }
+  return stress.mismatch_count != 0;
+}
+
+/* A backend with latency_ns round-trip time per call. */
+struct latency_image {
+  struct corpus_image *image;
+  struct timespec latency;
+  uint32_t round_trip_count;
+};
+
+static void latency_wait(struct latency_image *li) {
+  ++li->round_trip_count;
+  nanosleep(&li->latency, 0);
+}
+
+static int latency_read_block(void *li_ptr, uint64_t block_idx,
+                              uint32_t block_count, void *buf) {
+  struct latency_image *li = (struct latency_image*)li_ptr;
+  latency_wait(li);
+  return corpus_read_block(li->image, block_idx, block_count, buf);
+}
+
+static int latency_read_block_list(void *li_ptr, const uint64_t *block_idxs,
+                                   uint32_t block_count, void *buf) {
+  struct latency_image *li = (struct latency_image*)li_ptr;
+  latency_wait(li);
+  return corpus_read_block_list(li->image, block_idxs, block_count, buf);
+}
+
+/* Detects with the async API, fetching all ranges of a step in one round
+ * trip.
+ */
+static void latency_detect_async(struct latency_image *li,
+                                 const struct fsdetect_args *args,
+                                 struct fsdetect_output *fsdo) {
+  struct fsdetect_async fa;
+  struct fsdetect_range *r;
+  uint32_t new_count;
+  fsdetect_async_init(&fa, args);
+  while ((new_count = fsdetect_async_step(&fa, fsdo)) != 0) {
+    latency_wait(li);
+    for (r = fa.ranges + fa.range_count - new_count;
+         r != fa.ranges + fa.range_count; ++r) {
+      r->data = corpus_map_block(li->image, r->block_idx, r->block_count);
+      r->result = r->data ? 0 : -1;
+    }
+  }
+}
+
+static const char *const latency_mode_names[] = { "read", "plan", "async" };
+
+/* Returns nonzero on detection mismatch. */
+static int bench_latency(struct corpus_image *image, int mode,
+                         uint32_t latency_us, uint32_t iterations) {
+  struct latency_image li;
+  struct fsdetect_args args;
+  struct fsdetect_output fsdo;
+  unsigned char scratch[FSDETECT_SCRATCH_SIZE];
+  uint32_t i;
+  double start_ns, elapsed_ns;
+  li.image = image;
+  li.latency.tv_sec = latency_us / 1000000;
+  li.latency.tv_nsec = latency_us % 1000000 * 1000L;
+  li.round_trip_count = 0;
+  memset(&args, '\0', sizeof(args));
+  args.read_block64 = latency_read_block;
+  args.read_block_data = &li;
+  args.scratch = scratch;
+  args.scratch_size = sizeof(scratch);
+  if (mode == MODE_PLAN) args.read_block_list = latency_read_block_list;
+  start_ns = now_ns();
+  for (i = 0; i < iterations; ++i) {
+    if (mode == MODE_MAP) {
+      latency_detect_async(&li, &args, &fsdo);
+    } else {
+      fsdetect_ex(&args, &fsdo);
+    }
+  }
+  elapsed_ns = now_ns() - start_ns;
+  printf("%-6s %-5s %10.3f %8.2f %s\n", image->name, latency_mode_names[mode],
+         elapsed_ns / iterations / 1e6,
+         (double)li.round_trip_count / iterations, fsdo.fstype);
+  if (0 != strcmp(fsdo.fstype, image->fstype)) {
+    fprintf(stderr, "fatal: %s detected as %s, expected %s\n",
+            image->name, fsdo.fstype, image->fstype);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct corpus_image *images;
+  uint32_t image_count, i, iterations = 100000, thread_count = 0;
+  uint32_t latency_us = 0;
+  int mode, exit_code = 0;
+  char is_latency = 0;
+  if (argc > 2 && 0 == strcmp(argv[1], "-t")) {
+    thread_count = strtoul(argv[2], 0, 10);
+    if (thread_count == 0) thread_count = 1;
+    iterations = 1000;
+    argv += 2;
+    argc -= 2;
+  } else if (argc > 2 && 0 == strcmp(argv[1], "-l")) {
+    latency_us = strtoul(argv[2], 0, 10);
+    is_latency = 1;
+    iterations = 10;
+    argv += 2;
+    argc -= 2;
+  }
+  if (argc > 1) iterations = strtoul(argv[1], 0, 10);
+  if (iterations == 0) iterations = 1;
+  if (!(images = corpus_build(&image_count))) {
+    fprintf(stderr, "fatal: out of memory\n");
+    return 2;
+  }
+  if (thread_count != 0) {
+    exit_code = run_stress(images, image_count, thread_count, iterations);
+    free(images);
+    return exit_code;
+  }
+  if (is_latency) {
+    printf("image  mode  ms/detect  round_trips fstype\n");
+    for (i = 0; i < image_count; ++i) {
+      for (mode = MODE_READ; mode <= MODE_MAP; ++mode) {
+        exit_code |= bench_latency(images + i, mode, latency_us, iterations);
+      }
+    }
+    free(images);
+    return exit_code;
+  }
+  printf("image  mode  ns/detect    reads   bytes_read fstype\n");
+  for (i = 0; i < image_count; ++i) {
+    for (mode = MODE_READ; mode <= MODE_MAP; ++mode) {
+      exit_code |= bench_image(images + i, mode, iterations);
+    }
+  }
+  free(images);
+  exit_code |= bench_crc32c("table", fsdetect_crc32c_table, iterations / 10 + 1);
+  exit_code |= bench_crc32c("best", fsdetect_crc32c, iterations / 10 + 1);
+  return exit_code;
+}
@@ -63,40 +63,67 @@ struct btrfs_super_block {
 struct Assert512BytesStruct {
    int Assert512Bytes : sizeof(struct btrfs_super_block) == 512; };
 
+#define BTRFS_CSUM_TYPE_CRC32  0  /* Actually CRC32C. */
+#define BTRFS_CSUM_SIZE  32  /* The checksum covers the rest. */
+#define BTRFS_SUPER_INFO_SIZE  4096
+
+/* At 64 MiB and 256 GiB. */
+static const uint64_t mirror_block_idxs[2] = {
+    (uint64_t)64 << 11, (uint64_t)256 << 21 };
+
 /* Code based on util-linux-2.31/libblkid/src/superblocks/btrfs.c */
-int fsdetect_btrfs(read_block_t read_block, void *read_block_data,
+int fsdetect_btrfs(const struct fsdetect_reader *rd,
                    struct fsdetect_output *fsdo) {
-  struct btrfs_super_block sb;
-  if (read_block(read_block_data, 128, 1, &sb) != 0) return 10;
+  struct btrfs_super_block sb_buf;
+  const struct btrfs_super_block *sb;
+  unsigned char rest_buf[BTRFS_SUPER_INFO_SIZE - 512];
+  const unsigned char *rest;  /* Blocks after the first. */
+  uint32_t crc, i, sb_idx = 0;
+  struct btrfs_super_block mirror_bufs[2];
+  const struct btrfs_super_block *mirrors[2];
+  sb = (const struct btrfs_super_block*)get_blocks(
+      rd, BTRFS_SB_BLOCK, 1, &sb_buf);
+  if ((rd->flags & FSDETECT_BTRFS_MIRRORS) &&
+      (!sb || 0 == memcmp(sb->magic, "_BHRfS_M", 8))) {
+    /* Requested right after the primary, so that the io_uring engine reads
+     * them in the same pass. Those beyond the device fail, the rest are
+     * checked against dev_item.total_bytes below.
+     */
+    for (i = 0; i < 2; ++i) {
+      mirrors[i] = (const struct btrfs_super_block*)get_blocks(
+          rd, mirror_block_idxs[i], 1, mirror_bufs + i);
+    }
+  }
+  if (!sb) return 10;
   /* https://btrfs.wiki.kernel.org/index.php/On-disk_Format#Superblock */
   /* https://btrfs.wiki.kernel.org/index.php/Data_Structures#btrfs_super_block */
-  if (0 != memcmp(sb.magic, "_BHRfS_M", 8)) return 11;
-  if (le16(sb.csum_type) == 0 && !(sb.csum[4] == 0 && sb.csum[5] == 0 && sb.csum[6] == 0 && sb.csum[7] == 0)) return 12;
-  /* if (le64(sb.flags) == 0) return 13; */  /* BTRFS_HEADER_FLAG_WRITTEN? */
-  if (le64(sb.generation) < 4) return 14;
-  if (le64(sb.root) == le64(sb.chunk_root) || le64(sb.root) == le64(sb.log_root) || le64(sb.chunk_root) == le64(sb.log_root)) return 15;
-  if (le64(sb.total_bytes) < le64(sb.bytes_used)) return 16;
-  if (le64(sb.root_dir_objectid) < 6) return 17;
-  if (le64(sb.num_devices) == 0) return 18;
-  if (le64(sb.num_devices) > 0x200) return 19;
-  if (sb.sectorsize < 0x1000) return 20;
-  if (!is_power_of_2(sb.sectorsize)) return 21;
-  if (!is_power_of_2(le64(sb.nodesize)) || le64(sb.nodesize) > 0x10000) return 22;
-  if (le64(sb.nodesize) < sb.sectorsize) return 23;
-  if (!is_power_of_2(le64(sb.leafsize)) || le64(sb.leafsize) > 0x10000) return 24;
-  if (le64(sb.leafsize) < sb.sectorsize) return 25;
-  if (!is_power_of_2(sb.stripesize)) return 26;
-  if (sb.stripesize < sb.sectorsize) return 27;
-  if (le64(sb.chunk_root_generation) < 4) return 28;
-  if (le64(sb.dev_item.devid) == 0) return 29;
-  if (le64(sb.dev_item.total_bytes) > le64(sb.total_bytes)) return 30;
-  if (le64(sb.dev_item.total_bytes) < le64(sb.dev_item.bytes_used)) return 31;
-  if (sb.dev_item.io_align < 0x1000) return 32;
-  if (!is_power_of_2(sb.dev_item.io_align >> 12)) return 33;
-  if (sb.dev_item.io_width < 0x1000) return 34;
-  if (!is_power_of_2(sb.dev_item.io_width >> 12)) return 35;
-  if (le64(sb.dev_item.sector_size) < 0x1000) return 36;
-  if (!is_power_of_2(sb.dev_item.sector_size >> 12)) return 37;
+  if (0 != memcmp(sb->magic, "_BHRfS_M", 8)) return 11;
+  if (le16(sb->csum_type) == 0 && !(sb->csum[4] == 0 && sb->csum[5] == 0 && sb->csum[6] == 0 && sb->csum[7] == 0)) return 12;
+  /* if (le64(sb->flags) == 0) return 13; */  /* BTRFS_HEADER_FLAG_WRITTEN? */
+  if (le64(sb->generation) < 4) return 14;
+  if (le64(sb->root) == le64(sb->chunk_root) || le64(sb->root) == le64(sb->log_root) || le64(sb->chunk_root) == le64(sb->log_root)) return 15;
+  if (le64(sb->total_bytes) < le64(sb->bytes_used)) return 16;
+  if (le64(sb->root_dir_objectid) < 6) return 17;
+  if (le64(sb->num_devices) == 0) return 18;
+  if (le64(sb->num_devices) > 0x200) return 19;
+  if (sb->sectorsize < 0x1000) return 20;
+  if (!is_power_of_2(sb->sectorsize)) return 21;
+  if (!is_power_of_2(le64(sb->nodesize)) || le64(sb->nodesize) > 0x10000) return 22;
+  if (le64(sb->nodesize) < sb->sectorsize) return 23;
+  if (!is_power_of_2(le64(sb->leafsize)) || le64(sb->leafsize) > 0x10000) return 24;
+  if (le64(sb->leafsize) < sb->sectorsize) return 25;
+  if (!is_power_of_2(sb->stripesize)) return 26;
+  if (sb->stripesize < sb->sectorsize) return 27;
+  if (le64(sb->chunk_root_generation) < 4) return 28;
+  if (le64(sb->dev_item.devid) == 0) return 29;
+  if (le64(sb->dev_item.total_bytes) > le64(sb->total_bytes)) return 30;
+  if (le64(sb->dev_item.total_bytes) < le64(sb->dev_item.bytes_used)) return 31;
+  if (sb->dev_item.io_align < 0x1000) return 32;
+  if (!is_power_of_2(sb->dev_item.io_align >> 12)) return 33;
+  if (sb->dev_item.io_width < 0x1000) return 34;
+  if (!is_power_of_2(sb->dev_item.io_width >> 12)) return 35;
+  if (le64(sb->dev_item.sector_size) < 0x1000) return 36;
+  if (!is_power_of_2(sb->dev_item.sector_size >> 12)) return 37;
 
 #ifdef DEBUG
   /* Typical example:
@@ -140,49 +167,86 @@ int fsdetect_btrfs(read_block_t read_block, void *read_block_data,
    * dev_item.seek_speed=0x0
    * dev_item.bandwidth=0x0
    */
-  __extension__ printf("csum=<%02x%02x%02x%02x%02x%02x%02x%02x>\n", sb.csum[0], sb.csum[1], sb.csum[2], sb.csum[3], sb.csum[4], sb.csum[5], sb.csum[6], sb.csum[7]);
-  __extension__ printf("bytenr=0x%llx\n", (long long)le64(sb.bytenr));  /* Physical address of this block. */
-  __extension__ printf("flags=0x%llx\n", (long long)le64(sb.flags));
-  __extension__ printf("generation=0x%llx\n", (long long)le64(sb.generation));
-  __extension__ printf("root=0x%llx\n", (long long)le64(sb.root));
-  __extension__ printf("chunk_root=0x%llx\n", (long long)le64(sb.chunk_root));
-  __extension__ printf("log_root=0x%llx\n", (long long)le64(sb.log_root));
-  __extension__ printf("log_root_transid=0x%llx\n", (long long)le64(sb.log_root_transid));
-  __extension__ printf("total_bytes=0x%llx\n", (long long)le64(sb.total_bytes));
-  __extension__ printf("bytes_used=0x%llx\n", (long long)le64(sb.bytes_used));
-  __extension__ printf("root_dir_objectid=0x%llx\n", (long long)le64(sb.root_dir_objectid));
-  __extension__ printf("num_devices=0x%llx\n", (long long)le64(sb.num_devices));
-  __extension__ printf("sectorsize=0x%x\n", (int)le32(sb.sectorsize));
-  __extension__ printf("nodesize=0x%x\n", (int)le32(sb.nodesize));
-  __extension__ printf("leafsize=0x%x\n", (int)le32(sb.leafsize));
-  __extension__ printf("stripesize=0x%x\n", (int)le32(sb.stripesize));
-  __extension__ printf("sys_chunk_array_size=0x%x\n", (int)le32(sb.sys_chunk_array_size));
-  __extension__ printf("chunk_root_generation=0x%llx\n", (long long)le64(sb.chunk_root_generation));
-  __extension__ printf("compat_flags=0x%llx\n", (long long)le64(sb.compat_flags));
-  __extension__ printf("compat_ro_flags=0x%llx\n", (long long)le64(sb.compat_ro_flags));
-  __extension__ printf("incompat_flags=0x%llx\n", (long long)le64(sb.incompat_flags));
-  __extension__ printf("csum_type=0x%x\n", (int)le16(sb.csum_type));
-  __extension__ printf("root_level=0x%x\n", sb.root_level);
-  __extension__ printf("chunk_root_level=0x%x\n", sb.chunk_root_level);
-  __extension__ printf("log_root_level=0x%x\n", sb.log_root_level);
-  __extension__ printf("dev_item.devid=0x%llx\n", (long long)le64(sb.dev_item.devid));
-  __extension__ printf("dev_item.total_bytes=0x%llx\n", (long long)le64(sb.dev_item.total_bytes));
-  __extension__ printf("dev_item.bytes_used=0x%llx\n", (long long)le64(sb.dev_item.bytes_used));
-  __extension__ printf("dev_item.io_align=0x%x\n", (int)le32(sb.dev_item.io_align));
-  __extension__ printf("dev_item.io_width=0x%x\n", (int)le32(sb.dev_item.io_width));
-  __extension__ printf("dev_item.sector_size=0x%x\n", (int)le32(sb.dev_item.sector_size));
-  __extension__ printf("dev_item.type=0x%llx\n", (long long)le64(sb.dev_item.type));
-  __extension__ printf("dev_item.generation=0x%llx\n", (long long)le64(sb.dev_item.generation));
-  __extension__ printf("dev_item.start_offset=0x%llx\n", (long long)le64(sb.dev_item.start_offset));
-  __extension__ printf("dev_item.dev_group=0x%x\n", (int)le32(sb.dev_item.dev_group));
-  __extension__ printf("dev_item.seek_speed=0x%x\n", sb.dev_item.seek_speed);
-  __extension__ printf("dev_item.bandwidth=0x%x\n", sb.dev_item.bandwidth);
+  __extension__ printf("csum=<%02x%02x%02x%02x%02x%02x%02x%02x>\n", sb->csum[0], sb->csum[1], sb->csum[2], sb->csum[3], sb->csum[4], sb->csum[5], sb->csum[6], sb->csum[7]);
+  __extension__ printf("bytenr=0x%llx\n", (long long)le64(sb->bytenr));  /* Physical address of this block. */
+  __extension__ printf("flags=0x%llx\n", (long long)le64(sb->flags));
+  __extension__ printf("generation=0x%llx\n", (long long)le64(sb->generation));
+  __extension__ printf("root=0x%llx\n", (long long)le64(sb->root));
+  __extension__ printf("chunk_root=0x%llx\n", (long long)le64(sb->chunk_root));
+  __extension__ printf("log_root=0x%llx\n", (long long)le64(sb->log_root));
+  __extension__ printf("log_root_transid=0x%llx\n", (long long)le64(sb->log_root_transid));
+  __extension__ printf("total_bytes=0x%llx\n", (long long)le64(sb->total_bytes));
+  __extension__ printf("bytes_used=0x%llx\n", (long long)le64(sb->bytes_used));
+  __extension__ printf("root_dir_objectid=0x%llx\n", (long long)le64(sb->root_dir_objectid));
+  __extension__ printf("num_devices=0x%llx\n", (long long)le64(sb->num_devices));
+  __extension__ printf("sectorsize=0x%x\n", (int)le32(sb->sectorsize));
+  __extension__ printf("nodesize=0x%x\n", (int)le32(sb->nodesize));
+  __extension__ printf("leafsize=0x%x\n", (int)le32(sb->leafsize));
+  __extension__ printf("stripesize=0x%x\n", (int)le32(sb->stripesize));
+  __extension__ printf("sys_chunk_array_size=0x%x\n", (int)le32(sb->sys_chunk_array_size));
+  __extension__ printf("chunk_root_generation=0x%llx\n", (long long)le64(sb->chunk_root_generation));
+  __extension__ printf("compat_flags=0x%llx\n", (long long)le64(sb->compat_flags));
+  __extension__ printf("compat_ro_flags=0x%llx\n", (long long)le64(sb->compat_ro_flags));
+  __extension__ printf("incompat_flags=0x%llx\n", (long long)le64(sb->incompat_flags));
+  __extension__ printf("csum_type=0x%x\n", (int)le16(sb->csum_type));
+  __extension__ printf("root_level=0x%x\n", sb->root_level);
+  __extension__ printf("chunk_root_level=0x%x\n", sb->chunk_root_level);
+  __extension__ printf("log_root_level=0x%x\n", sb->log_root_level);
+  __extension__ printf("dev_item.devid=0x%llx\n", (long long)le64(sb->dev_item.devid));
+  __extension__ printf("dev_item.total_bytes=0x%llx\n", (long long)le64(sb->dev_item.total_bytes));
+  __extension__ printf("dev_item.bytes_used=0x%llx\n", (long long)le64(sb->dev_item.bytes_used));
+  __extension__ printf("dev_item.io_align=0x%x\n", (int)le32(sb->dev_item.io_align));
+  __extension__ printf("dev_item.io_width=0x%x\n", (int)le32(sb->dev_item.io_width));
+  __extension__ printf("dev_item.sector_size=0x%x\n", (int)le32(sb->dev_item.sector_size));
+  __extension__ printf("dev_item.type=0x%llx\n", (long long)le64(sb->dev_item.type));
+  __extension__ printf("dev_item.generation=0x%llx\n", (long long)le64(sb->dev_item.generation));
+  __extension__ printf("dev_item.start_offset=0x%llx\n", (long long)le64(sb->dev_item.start_offset));
+  __extension__ printf("dev_item.dev_group=0x%x\n", (int)le32(sb->dev_item.dev_group));
+  __extension__ printf("dev_item.seek_speed=0x%x\n", sb->dev_item.seek_speed);
+  __extension__ printf("dev_item.bandwidth=0x%x\n", sb->dev_item.bandwidth);
 #endif
 
+  /* Other checksum types (xxhash64, sha256, blake2b) aren't verified. */
+  if ((rd->flags & FSDETECT_VERIFY_CSUM) &&
+      le16(sb->csum_type) == BTRFS_CSUM_TYPE_CRC32) {
+    if (!(rest = (const unsigned char*)get_blocks(
+        rd, BTRFS_SB_BLOCK + 1, (BTRFS_SUPER_INFO_SIZE >> 9) - 1, rest_buf)))
+      return 38;
+    crc = fsdetect_crc32c(~(uint32_t)0, (const unsigned char*)sb +
+                          BTRFS_CSUM_SIZE, 512 - BTRFS_CSUM_SIZE);
+    crc = ~fsdetect_crc32c(crc, rest, BTRFS_SUPER_INFO_SIZE - 512);
+    if (crc != get_le32(sb->csum)) return 39;
+  }
+
+  if (rd->flags & FSDETECT_BTRFS_MIRRORS) {
+    /* Only the mirrors within the device. A mirror which can't be read or
+     * doesn't match is ignored.
+     */
+    for (i = 0; i < 2; ++i) {
+      if (mirrors[i] && mirror_block_idxs[i] + (BTRFS_SUPER_INFO_SIZE >> 9) <=
+          le64(sb->dev_item.total_bytes) >> 9 &&
+          0 == memcmp(mirrors[i]->magic, "_BHRfS_M", 8) &&
+          le64(mirrors[i]->bytenr) == mirror_block_idxs[i] << 9 &&
+          0 == memcmp(mirrors[i]->fsid, sb->fsid, 16) &&
+          le64(mirrors[i]->dev_item.devid) == le64(sb->dev_item.devid) &&
+          le64(mirrors[i]->generation) > le64(sb->generation)) {
+        sb = mirrors[i];
+        sb_idx = i + 1;
+      }
+    }
+  }
+  if (rd->btrfs_info) {
+    rd->btrfs_info->devid = le64(sb->dev_item.devid);
+    rd->btrfs_info->num_devices = le64(sb->num_devices);
+    rd->btrfs_info->generation = le64(sb->generation);
+    memcpy(rd->btrfs_info->dev_uuid, sb->dev_item.uuid, 16);
+    rd->btrfs_info->sb_idx = sb_idx;
+  }
+
   strcpy(fsdo->fstype, "btrfs");
-  strncpy(fsdo->label, (const char*)sb.label, 16);
+  strncpy(fsdo->label, (const char*)sb->label, 16);
   fsdo->label[16] = '\0';
   fsdo->uuid_size = 16;
-  memcpy(fsdo->uuid, sb.fsid, 16);
+  memcpy(fsdo->uuid, sb->fsid, 16);
   return 0;
 }
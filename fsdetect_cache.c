@@ -0,0 +1,88 @@
+#include "fsdetect_impl.h"
+
+void fsdetect_cache_init(struct fsdetect_cache *cache,
+                         read_block64_t read_block, void *read_block_data) {
+  cache->read_block = read_block;
+  cache->read_block_data = read_block_data;
+  cache->used_count = cache->next_idx = 0;
+  cache->stats.hit_count = cache->stats.miss_count = 0;
+}
+
+int fsdetect_cache_read_block_list(struct fsdetect_cache *cache,
+                                   read_block_list_t read_block_list,
+                                   void *read_block_list_data,
+                                   const uint64_t *block_idxs,
+                                   uint32_t block_count) {
+  int result;
+  cache->stats.miss_count += block_count;
+  FSDETECT_TRACE1(read_list__start, block_count);
+  /* Read directly to the cache entries, no need to copy. */
+  result = read_block_list(read_block_list_data, block_idxs, block_count,
+                           cache->blocks);
+  FSDETECT_TRACE2(read_list__done, block_count, result);
+  if (result != 0) return -1;
+  memcpy(cache->block_idxs, block_idxs, block_count * sizeof(uint64_t));
+  cache->used_count = block_count;
+  cache->next_idx = block_count == FSDETECT_CACHE_SIZE ? 0 : block_count;
+  return 0;
+}
+
+const unsigned char *fsdetect_cache_find(const struct fsdetect_cache *cache,
+                                         uint64_t block_idx) {
+  uint32_t i;
+  for (i = 0; i < cache->used_count; ++i) {
+    if (cache->block_idxs[i] == block_idx) return cache->blocks[i];
+  }
+  return 0;
+}
+
+/* Reads block_count blocks from the backend to buf, and adds them to the
+ * cache.
+ */
+static int read_missing(struct fsdetect_cache *cache, uint64_t block_idx,
+                        uint32_t block_count, unsigned char *buf) {
+  int result;
+  cache->stats.miss_count += block_count;
+  FSDETECT_TRACE2(read__start, block_idx, block_count);
+  result = cache->read_block(cache->read_block_data, block_idx, block_count,
+                             buf);
+  FSDETECT_TRACE3(read__done, block_idx, block_count, result);
+  if (result != 0) return -1;
+  for (; block_count > 0; --block_count, ++block_idx, buf += 512) {
+    memcpy(cache->blocks[cache->next_idx], buf, 512);
+    cache->block_idxs[cache->next_idx] = block_idx;
+    if (cache->used_count <= cache->next_idx) ++cache->used_count;
+    if (++cache->next_idx == FSDETECT_CACHE_SIZE) cache->next_idx = 0;
+  }
+  return 0;
+}
+
+int fsdetect_cache_read_block(void *cache_ptr, uint64_t block_idx,
+                              uint32_t block_count, void *buf) {
+  struct fsdetect_cache *cache = (struct fsdetect_cache*)cache_ptr;
+  unsigned char *p = (unsigned char*)buf;
+  uint64_t miss_idx = 0;
+  uint32_t i, miss_count = 0;  /* Pending run of misses. */
+  const unsigned char *cached;
+  for (i = 0; i < block_count; ++i, p += 512) {
+    if ((cached = fsdetect_cache_find(cache, block_idx + i)) != 0) {
+      /* Copy before read_missing, because it may evict cached. */
+      memcpy(p, cached, 512);
+      ++cache->stats.hit_count;
+      if (miss_count != 0) {
+        if (read_missing(cache, miss_idx, miss_count,
+                         p - (miss_count << 9)) != 0) goto err;
+        miss_count = 0;
+      }
+    } else if (miss_count++ == 0) {
+      miss_idx = block_idx + i;
+    }
+  }
+  if (miss_count != 0 &&
+      read_missing(cache, miss_idx, miss_count, p - (miss_count << 9)) != 0
+     ) { err:
+    memset(buf, '\0', (size_t)block_count << 9);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,40 @@
+#include "fsdetect_impl.h"
+
+/* Offset of each signature from the filesystem start, in blocks. */
+struct AssertCarveStruct {
+   int AssertCarve : FAT_SB_BLOCK == 0 && NTFS_SB_BLOCK == 0 &&
+       EXT_SB_BLOCK == 2 && BTRFS_SB_BLOCK == 128; };
+
+/* fsdetect_prefilter is branch-free, and it looks at only a few words of
+ * each block, so this is limited by memory bandwidth rather than by the
+ * comparisons. Candidates are rare, so the branch on the mask is
+ * predictable.
+ */
+uint32_t fsdetect_carve(const void *blocks, uint32_t block_count,
+                        uint64_t first_block_idx,
+                        struct fsdetect_candidate *candidates) {
+  const unsigned char *block = (const unsigned char*)blocks;
+  struct fsdetect_candidate *c = candidates;
+  uint64_t block_idx = first_block_idx;
+  uint32_t mask;
+  for (; block_count > 0; --block_count, ++block_idx, block += 512) {
+    /* The same block in all 3 positions, each signature is looked up at
+     * its own offset.
+     */
+    if ((mask = fsdetect_prefilter(block, block, block) &
+                FSDETECT_PROBE_ENABLED) == 0) continue;
+    if (mask & (FSDETECT_PROBE_FAT | FSDETECT_PROBE_NTFS)) {
+      c->start_block = block_idx;
+      c++->probe_mask = mask & (FSDETECT_PROBE_FAT | FSDETECT_PROBE_NTFS);
+    }
+    if ((mask & FSDETECT_PROBE_EXT) && block_idx >= EXT_SB_BLOCK) {
+      c->start_block = block_idx - EXT_SB_BLOCK;
+      c++->probe_mask = FSDETECT_PROBE_EXT;
+    }
+    if ((mask & FSDETECT_PROBE_BTRFS) && block_idx >= BTRFS_SB_BLOCK) {
+      c->start_block = block_idx - BTRFS_SB_BLOCK;
+      c++->probe_mask = FSDETECT_PROBE_BTRFS;
+    }
+  }
+  return c - candidates;
+}
@@ -0,0 +1,273 @@
+#include "fsdetect_corpus.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void put16(unsigned char *p, uint16_t x) {
+  p[0] = x; p[1] = x >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t x) {
+  put16(p, x); put16(p + 2, x >> 16);
+}
+
+static void put64(unsigned char *p, uint64_t x) {
+  put32(p, x); put32(p + 4, x >> 32);
+}
+
+static void init_image(struct corpus_image *image, const char *name,
+                       const char *fstype, uint64_t block_count) {
+  image->name = name;
+  image->fstype = fstype;
+  image->block_count = block_count;
+  memset(image->data, '\0', sizeof(image->data));
+}
+
+/* Boot sector common to FAT12, FAT16 and FAT32. */
+static void build_fat_bpb(unsigned char *p, uint8_t cluster_size,
+                          uint16_t reserved, uint16_t root_entries,
+                          uint32_t sectors, uint8_t media,
+                          uint16_t fat_length) {
+  memcpy(p, "\xeb\x3c\x90" "mkfs.fat", 11);
+  put16(p + 0x0b, 512);
+  p[0x0d] = cluster_size;
+  put16(p + 0x0e, reserved);
+  p[0x10] = 2;  /* ms_fats. */
+  put16(p + 0x11, root_entries);
+  if (sectors < 0x10000) {
+    put16(p + 0x13, sectors);
+  } else {
+    put32(p + 0x20, sectors);
+  }
+  p[0x15] = media;
+  put16(p + 0x16, fat_length);
+  put16(p + 0x18, 63);  /* ms_secs_track. */
+  put16(p + 0x1a, 255);  /* ms_heads. */
+  put16(p + 0x1fe, 0xaa55);
+}
+
+static void build_fat1x(struct corpus_image *image, char is_fat16) {
+  unsigned char *p = image->data;
+  if (is_fat16) {
+    init_image(image, "fat16", "fat16", 32768);
+    build_fat_bpb(p, 4, 1, 512, 32768, 0xf8, 32);
+  } else {  /* 1.44 MB floppy. */
+    init_image(image, "fat12", "fat12", 2880);
+    build_fat_bpb(p, 1, 1, 224, 2880, 0xf0, 9);
+  }
+  p[0x26] = 0x29;  /* Extended boot signature. */
+  memcpy(p + 0x27, "\x1f\xaf\xbc\xea", 4);
+  memcpy(p + 0x2b, "CORPUS     ", 11);
+  memcpy(p + 0x36, is_fat16 ? "FAT16   " : "FAT12   ", 8);
+}
+
+static void build_fat32(struct corpus_image *image) {
+  unsigned char *p = image->data;
+  init_image(image, "fat32", "fat32", 81920);
+  build_fat_bpb(p, 1, 32, 0, 81920, 0xf8, 0);
+  p[0] = 0xeb; p[1] = 0x58;
+  put32(p + 0x24, 630);  /* fat32_length. */
+  put32(p + 0x2c, 2);  /* root_cluster. */
+  put16(p + 0x30, 1);  /* fsinfo_sector. */
+  put16(p + 0x32, 6);  /* backup_boot. */
+  p[0x42] = 0x29;
+  memcpy(p + 0x43, "\x01\x02\x03\x04", 4);
+  memcpy(p + 0x47, "CORPUS32   ", 11);
+  memcpy(p + 0x52, "FAT32   ", 8);
+  p += 512;  /* fsinfo. */
+  memcpy(p, "RRaA", 4);
+  memcpy(p + 484, "rrAa", 4);
+  put16(p + 0x1fe, 0xaa55);
+}
+
+/* for s_feature_* */
+#define EXT3_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+#define EXT4_FEATURE_RO_COMPAT_HUGE_FILE 0x0008
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define EXT4_FEATURE_INCOMPAT_EXTENTS 0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG 0x0200
+
+static void build_ext(struct corpus_image *image, int version) {
+  static const char *const names[] = { "ext2", "ext3", "ext4" };
+  unsigned char *p = image->data + 0x400;
+  uint32_t compat = 0, incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+  uint32_t ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER |
+                       EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+  init_image(image, names[version - 2], names[version - 2], 65536 * 8);
+  if (version >= 3) compat |= EXT3_FEATURE_COMPAT_HAS_JOURNAL;
+  if (version >= 4) {
+    incompat |= EXT4_FEATURE_INCOMPAT_EXTENTS | EXT4_FEATURE_INCOMPAT_64BIT |
+                EXT4_FEATURE_INCOMPAT_FLEX_BG;
+    ro_compat |= EXT4_FEATURE_RO_COMPAT_HUGE_FILE;
+  }
+  put32(p + 0x00, 16384);  /* s_inodes_count. */
+  put32(p + 0x04, 65536);  /* s_blocks_count. */
+  put32(p + 0x08, 3276);  /* s_r_blocks_count. */
+  put32(p + 0x0c, 60000);  /* s_free_blocks_count. */
+  put32(p + 0x10, 16373);  /* s_free_inodes_count. */
+  put32(p + 0x18, 2);  /* s_log_block_size: 4096. */
+  put32(p + 0x30, 0x5a000000);  /* s_wtime. */
+  p[0x38] = 0x53; p[0x39] = 0xef;  /* s_magic. */
+  put16(p + 0x3a, 1);  /* s_state. */
+  put16(p + 0x3c, 1);  /* s_errors. */
+  put32(p + 0x4c, 1);  /* s_rev_level. */
+  put32(p + 0x54, 11);  /* s_first_ino. */
+  put16(p + 0x58, 256);  /* s_inode_size. */
+  put32(p + 0x5c, compat);
+  put32(p + 0x60, incompat);
+  put32(p + 0x64, ro_compat);
+  memcpy(p + 0x68, "\xf2\xbc\x27\x4a\x3c\xd2\x49\x3d"
+                   "\x9e\x75\xf6\xfd\xf6\x82\xde\x90", 16);  /* s_uuid. */
+  memcpy(p + 0x78, "corpus", 6);  /* s_volume_name. */
+  put16(p + 0xce, 15);  /* s_reserved_gdt_blocks. */
+}
+
+/* Builds an MFT record with fixups for 512-byte sectors. */
+static void build_mft_record(unsigned char *p, uint32_t record_size,
+                             const char *volume_name) {
+  unsigned char *q;
+  uint32_t i;
+  memcpy(p, "FILE", 4);
+  put16(p + 0x04, 0x30);  /* usa_ofs. */
+  put16(p + 0x06, 1 + record_size / 512);  /* usa_count. */
+  put16(p + 0x14, 0x38);  /* attrs_offset. */
+  put16(p + 0x16, 1);  /* flags: in use. */
+  put32(p + 0x1c, record_size);  /* bytes_allocated. */
+  q = p + 0x38;
+  if (volume_name) {  /* $VOLUME_NAME attribute, resident. */
+    const uint32_t name_size = strlen(volume_name) * 2;
+    const uint32_t attr_size = (0x18 + name_size + 7) & ~7;
+    put32(q, 0x60);  /* type. */
+    put32(q + 4, attr_size);  /* len. */
+    put32(q + 0x10, name_size);  /* value_len. */
+    put16(q + 0x14, 0x18);  /* value_offset. */
+    for (i = 0; i < name_size / 2; ++i) {
+      q[0x18 + 2 * i] = volume_name[i];
+    }
+    q += attr_size;
+  }
+  put32(q, 0xffffffffU);  /* End of attributes. */
+  put32(p + 0x18, q + 8 - p);  /* bytes_in_use. */
+  /* Update sequence: move the last 2 bytes of each sector to the array. */
+  put16(p + 0x30, 1);  /* Update sequence number. */
+  for (i = 0; i < record_size / 512; ++i) {
+    memcpy(p + 0x32 + 2 * i, p + 510 + 512 * i, 2);
+    put16(p + 510 + 512 * i, 1);
+  }
+}
+
+static void build_ntfs(struct corpus_image *image) {
+  unsigned char *p = image->data;
+  uint32_t i;
+  init_image(image, "ntfs", "ntfs", 1 << 21);
+  memcpy(p, "\xeb\x52\x90" "NTFS    ", 11);
+  put16(p + 0x0b, 512);
+  p[0x0d] = 8;  /* sectors_per_cluster. */
+  p[0x15] = 0xf8;
+  put16(p + 0x18, 63);
+  put16(p + 0x1a, 255);
+  put64(p + 0x28, (1 << 21) - 1);  /* number_of_sectors. */
+  put64(p + 0x30, 4);  /* mft_cluster_location. */
+  put64(p + 0x38, 8);  /* mft_mirror_cluster_location. */
+  p[0x40] = 0xf6;  /* clusters_per_mft_record: 1 << 10. */
+  p[0x44] = 1;  /* cluster_per_index_record. */
+  memcpy(p + 0x48, "\x01\x02\x03\x04\x05\x06\x07\x08", 8);
+  put16(p + 0x1fe, 0xaa55);
+  for (i = 0; i < 4; ++i) {  /* $MFT, $MFTMirr, $LogFile, $Volume. */
+    build_mft_record(p + 4 * 4096 + i * 1024, 1024, i == 3 ? "Corpus" : 0);
+  }
+}
+
+static void build_btrfs(struct corpus_image *image) {
+  unsigned char *p = image->data + 0x10000;
+  init_image(image, "btrfs", "btrfs", 100 << 11);
+  memcpy(p + 0x20, "\x00\x01\x02\x03\x04\x05\x06\x07"
+                   "\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f", 16);  /* fsid. */
+  put64(p + 0x30, 0x10000);  /* bytenr. */
+  put64(p + 0x38, 1);  /* flags. */
+  memcpy(p + 0x40, "_BHRfS_M", 8);
+  put64(p + 0x48, 7);  /* generation. */
+  put64(p + 0x50, 0x405000);  /* root. */
+  put64(p + 0x58, 0x20000);  /* chunk_root. */
+  put64(p + 0x70, 100 << 20);  /* total_bytes. */
+  put64(p + 0x78, 0x7000);  /* bytes_used. */
+  put64(p + 0x80, 6);  /* root_dir_objectid. */
+  put64(p + 0x88, 1);  /* num_devices. */
+  put32(p + 0x90, 4096);  /* sectorsize. */
+  put32(p + 0x94, 16384);  /* nodesize. */
+  put32(p + 0x98, 16384);  /* leafsize. */
+  put32(p + 0x9c, 4096);  /* stripesize. */
+  put32(p + 0xa0, 0x61);  /* sys_chunk_array_size. */
+  put64(p + 0xa4, 6);  /* chunk_root_generation. */
+  put64(p + 0xbc, 0x45);  /* incompat_flags. */
+  put64(p + 0xc9, 1);  /* dev_item.devid. */
+  put64(p + 0xd1, 100 << 20);  /* dev_item.total_bytes. */
+  put64(p + 0xd9, 12 << 20);  /* dev_item.bytes_used. */
+  put32(p + 0xe1, 4096);  /* dev_item.io_align. */
+  put32(p + 0xe5, 4096);  /* dev_item.io_width. */
+  put32(p + 0xe9, 4096);  /* dev_item.sector_size. */
+  memcpy(p + 0x12b, "corpus", 6);  /* label. */
+}
+
+static void build_junk(struct corpus_image *image) {
+  uint32_t x = 0x12345678, i;  /* xorshift32, for reproducibility. */
+  init_image(image, "junk", "?", 1 << 21);
+  for (i = 0; i < sizeof(image->data); ++i) {
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    image->data[i] = x;
+  }
+}
+
+struct corpus_image *corpus_build(uint32_t *image_count_out) {
+  const uint32_t image_count = 10;
+  struct corpus_image *images = (struct corpus_image*)malloc(
+      image_count * sizeof(*images));
+  if (!images) return 0;
+  build_fat1x(images, 0);
+  build_fat1x(images + 1, 1);
+  build_fat32(images + 2);
+  build_ext(images + 3, 2);
+  build_ext(images + 4, 3);
+  build_ext(images + 5, 4);
+  build_ntfs(images + 6);
+  build_btrfs(images + 7);
+  init_image(images + 8, "blank", "?", 1 << 21);
+  build_junk(images + 9);
+  *image_count_out = image_count;
+  return images;
+}
+
+static const unsigned char zeros[64 << 10];
+
+const void *corpus_map_block(void *image_ptr, uint64_t block_idx,
+                             uint32_t block_count) {
+  const struct corpus_image *image = (const struct corpus_image*)image_ptr;
+  const uint64_t ofs = block_idx << 9, size = (uint64_t)block_count << 9;
+  if (block_idx >= image->block_count ||
+      block_count > image->block_count - block_idx) return 0;
+  if (ofs + size <= CORPUS_DATA_SIZE) return image->data + ofs;
+  if (ofs >= CORPUS_DATA_SIZE && size <= sizeof(zeros)) return zeros;
+  return 0;  /* Not needed by the probes. */
+}
+
+int corpus_read_block(void *image_ptr, uint64_t block_idx,
+                      uint32_t block_count, void *buf) {
+  const void *p = corpus_map_block(image_ptr, block_idx, block_count);
+  if (!p) {
+    memset(buf, '\0', (size_t)block_count << 9);
+    return -1;
+  }
+  memcpy(buf, p, (size_t)block_count << 9);
+  return 0;
+}
+
+int corpus_read_block_list(void *image_ptr, const uint64_t *block_idxs,
+                           uint32_t block_count, void *buf) {
+  char *p = (char*)buf;
+  for (; block_count > 0; --block_count, p += 512) {
+    if (corpus_read_block(image_ptr, *block_idxs++, 1, p) != 0) return -1;
+  }
+  return 0;
+}
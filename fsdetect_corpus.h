@@ -0,0 +1,37 @@
+#ifndef _FSDETECT_CORPUS_H
+#define _FSDETECT_CORPUS_H 1
+
+/* In-memory corpus of synthetic filesystem images for fsdetect_bench. */
+
+#include "fsdetect.h"
+
+/* The first CORPUS_DATA_SIZE bytes of each image are stored, the rest (up
+ * to block_count blocks) reads as zeros. It covers all blocks the probes
+ * read: the superblocks up to BTRFS_SB_BLOCK, the FAT32 fsinfo sector and
+ * the NTFS MFT records.
+ */
+#define CORPUS_DATA_SIZE (72 << 10)
+
+struct corpus_image {
+  const char *name;  /* e.g. "fat16", "junk". */
+  const char *fstype;  /* Expected fsdetect_output.fstype. */
+  uint64_t block_count;  /* Size of the image. */
+  unsigned char data[CORPUS_DATA_SIZE];
+};
+
+/* Returns a malloc()ed array of images, with the count in *image_count_out.
+ * Returns NULL on out of memory.
+ */
+struct corpus_image *corpus_build(uint32_t *image_count_out);
+
+/* read_block64_t callback, pass a struct corpus_image* as fd_ptr. */
+int corpus_read_block(void *image_ptr, uint64_t block_idx,
+                      uint32_t block_count, void *buf);
+/* read_block_list_t callback, pass a struct corpus_image* as fd_ptr. */
+int corpus_read_block_list(void *image_ptr, const uint64_t *block_idxs,
+                           uint32_t block_count, void *buf);
+/* map_block_t callback, pass a struct corpus_image* as fd_ptr. */
+const void *corpus_map_block(void *image_ptr, uint64_t block_idx,
+                             uint32_t block_count);
+
+#endif  /* _FSDETECT_CORPUS_H */
@@ -0,0 +1,396 @@
+/* Daemon mode (fsdetect -D <socket>): keeps the detection results of all
+ * block devices (and of the images in the watched directories) in memory,
+ * and answers queries on a Unix domain socket.
+ *
+ * Protocol: the client sends one path per line, the daemon answers each
+ * with one line in the batch mode output format. Paths not in the table
+ * are detected on demand, and added to it only if they are in /dev or in
+ * a watched directory (nothing refreshes the others), and could be opened.
+ *
+ * The table is refreshed when the kernel reports a change: block device
+ * add, change and remove uevents (netlink), and inotify events in the
+ * watched directories. Everything runs on a single thread with poll(), the
+ * initial detection uses the batch worker threads.
+ */
+
+#include "fsdetect_tool.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_MAX_WATCHES 256
+#define DAEMON_LINE_MAX 4096
+
+struct result {
+  struct result *next;  /* In the same hash bucket. */
+  struct fsdetect_output fsdo;
+  char path[1];  /* Actually longer, NUL-terminated. */
+};
+
+struct client {
+  int fd;
+  uint32_t size;  /* Number of bytes in buf. */
+  char buf[DAEMON_LINE_MAX];
+};
+
+struct watch {
+  int wd;
+  const char *dir;  /* Without a trailing slash. */
+};
+
+struct daemon {
+  struct result **buckets;
+  uint32_t bucket_count;  /* Power of 2. */
+  uint32_t result_count;
+  struct watch watches[DAEMON_MAX_WATCHES];
+  uint32_t watch_count;
+  struct client *clients[DAEMON_MAX_CLIENTS];
+  uint32_t client_count;
+  uint32_t flags;  /* For batch_start. */
+  emit_result_t emit_result;
+};
+
+/* FNV-1a. */
+static uint32_t hash_path(const char *path) {
+  uint32_t hash = 0x811c9dc5;
+  for (; *path != '\0'; ++path) {
+    hash = (hash ^ (unsigned char)*path) * 0x1000193;
+  }
+  return hash;
+}
+
+static struct result **find_result(struct daemon *dm, const char *path) {
+  struct result **rp = dm->buckets + (hash_path(path) & (dm->bucket_count - 1));
+  for (; *rp && 0 != strcmp((*rp)->path, path); rp = &(*rp)->next) {}
+  return rp;
+}
+
+/* Doubles the number of buckets. Returns nonzero on out of memory. */
+static int grow_table(struct daemon *dm) {
+  struct result **buckets, *r, *next;
+  const uint32_t bucket_count = dm->bucket_count << 1;
+  uint32_t i;
+  if (!(buckets = (struct result**)calloc(bucket_count, sizeof(*buckets)))
+     ) return -1;
+  for (i = 0; i < dm->bucket_count; ++i) {
+    for (r = dm->buckets[i]; r; r = next) {
+      next = r->next;
+      r->next = buckets[hash_path(r->path) & (bucket_count - 1)];
+      buckets[hash_path(r->path) & (bucket_count - 1)] = r;
+    }
+  }
+  free(dm->buckets);
+  dm->buckets = buckets;
+  dm->bucket_count = bucket_count;
+  return 0;
+}
+
+/* Adds or updates the result of path. Returns NULL on out of memory. */
+static struct result *set_result(struct daemon *dm, const char *path,
+                                 const struct fsdetect_output *fsdo) {
+  struct result **rp = find_result(dm, path), *r = *rp;
+  const size_t path_size = strlen(path) + 1;
+  if (!r) {
+    if (dm->result_count >= dm->bucket_count && grow_table(dm) == 0) {
+      rp = find_result(dm, path);
+    }
+    if (!(r = (struct result*)malloc(sizeof(*r) + path_size))) return 0;
+    memcpy(r->path, path, path_size);
+    r->next = 0;
+    *rp = r;
+    ++dm->result_count;
+  }
+  r->fsdo = *fsdo;
+  return r;
+}
+
+static void remove_result(struct daemon *dm, const char *path) {
+  struct result **rp = find_result(dm, path), *r = *rp;
+  if (r) {
+    *rp = r->next;
+    free(r);
+    --dm->result_count;
+  }
+}
+
+/* Returns nonzero if path is in /dev or in a watched directory, so its
+ * result is kept up to date by uevents or inotify.
+ */
+static char is_watched(const struct daemon *dm, const char *path) {
+  const char *slash = strrchr(path, '/');
+  const size_t dir_size = slash ? (size_t)(slash - path) : 0;
+  uint32_t i;
+  if (dir_size == 4 && 0 == memcmp(path, "/dev", 4)) return 1;
+  for (i = 0; i < dm->watch_count; ++i) {
+    if (strlen(dm->watches[i].dir) == dir_size &&
+        0 == memcmp(dm->watches[i].dir, path, dir_size)) return 1;
+  }
+  return 0;
+}
+
+/* Detects the filesystem on path to *fsdo. Stores the result if path is
+ * watched, removes it if path can't be opened. Returns nonzero on out of
+ * memory.
+ */
+static int detect_path(struct daemon *dm, const char *path,
+                       struct fsdetect_output *fsdo) {
+  struct batch_item item;
+  struct batch *batch;
+  memset(&item, '\0', sizeof(item));
+  item.path = path;
+  if (!(batch = batch_start(&item, 1, 0, dm->flags))) return -1;
+  batch_wait_item(batch, 0);  /* Runs on this thread. */
+  batch_finish(batch);
+  *fsdo = item.fsdo;
+  if (item.is_open_failed) {
+    remove_result(dm, path);
+  } else if (is_watched(dm, path) && !set_result(dm, path, fsdo)) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Detects the filesystems on paths in parallel, and stores the results. */
+static void detect_paths(struct daemon *dm, char **paths, uint32_t path_count,
+                         uint32_t thread_count) {
+  struct batch_item *items;
+  struct batch *batch;
+  uint32_t i;
+  if (path_count == 0) return;
+  if (!(items = (struct batch_item*)calloc(path_count, sizeof(*items)))) return;
+  for (i = 0; i < path_count; ++i) {
+    items[i].path = paths[i];
+  }
+  if ((batch = batch_start(items, path_count, thread_count, dm->flags))) {
+    for (i = 0; i < path_count; ++i) {
+      batch_wait_item(batch, i);
+      if (!items[i].is_open_failed) set_result(dm, paths[i], &items[i].fsdo);
+    }
+    batch_finish(batch);
+  }
+  free(items);
+}
+
+/* Handles a kernel uevent: "ACTION@DEVPATH\0KEY=VALUE\0...". */
+static void handle_uevent(struct daemon *dm, const char *msg, size_t size) {
+  const char *p, *end = msg + size;
+  const char *action = 0, *subsystem = 0, *devname = 0;
+  char path[DAEMON_LINE_MAX];
+  struct fsdetect_output fsdo;
+  for (p = msg; p < end; p += strlen(p) + 1) {
+    if (0 == strncmp(p, "ACTION=", 7)) action = p + 7;
+    if (0 == strncmp(p, "SUBSYSTEM=", 10)) subsystem = p + 10;
+    if (0 == strncmp(p, "DEVNAME=", 8)) devname = p + 8;
+  }
+  if (!action || !subsystem || !devname || 0 != strcmp(subsystem, "block") ||
+      strlen(devname) + 6 > sizeof(path)) return;
+  strcpy(path, "/dev/");
+  strcat(path, devname);
+  if (0 == strcmp(action, "remove")) {
+    remove_result(dm, path);
+  } else if (0 == strcmp(action, "add") || 0 == strcmp(action, "change")) {
+    detect_path(dm, path, &fsdo);
+  }
+}
+
+static void handle_inotify(struct daemon *dm, const char *buf, size_t size) {
+  const struct inotify_event *ev;
+  const char *p;
+  char path[DAEMON_LINE_MAX];
+  struct fsdetect_output fsdo;
+  uint32_t i;
+  for (p = buf; p < buf + size; p += sizeof(*ev) + ev->len) {
+    ev = (const struct inotify_event*)p;
+    for (i = 0; i < dm->watch_count && dm->watches[i].wd != ev->wd; ++i) {}
+    if (i == dm->watch_count || ev->len == 0 ||
+        strlen(dm->watches[i].dir) + strlen(ev->name) + 2 > sizeof(path)
+       ) continue;
+    strcpy(path, dm->watches[i].dir);
+    strcat(path, "/");
+    strcat(path, ev->name);
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+      remove_result(dm, path);
+    } else {  /* IN_CLOSE_WRITE, IN_MOVED_TO. */
+      detect_path(dm, path, &fsdo);
+    }
+  }
+}
+
+/* Answers the complete lines in client->buf. Returns nonzero if the
+ * client should be disconnected.
+ */
+static int handle_client(struct daemon *dm, struct client *client) {
+  char outbuf[DAEMON_LINE_MAX + 256], *line = client->buf, *nl, *p;
+  struct fsdetect_output fsdo;
+  struct result *r;
+  ssize_t got = read(client->fd, client->buf + client->size,
+                     sizeof(client->buf) - client->size);
+  if (got <= 0) return -1;
+  client->size += got;
+  for (; (nl = (char*)memchr(line, '\n', client->buf + client->size - line));
+       line = nl + 1) {
+    *nl = '\0';
+    if ((r = *find_result(dm, line))) {
+      fsdo = r->fsdo;
+    } else if (detect_path(dm, line, &fsdo) != 0) {
+      return -1;
+    }
+    p = dm->emit_result(outbuf, line, &fsdo);
+    if (send(client->fd, outbuf, p - outbuf, MSG_NOSIGNAL) != p - outbuf
+       ) return -1;
+  }
+  if (line == client->buf && client->size == sizeof(client->buf)) {
+    return -1;  /* Line too long. */
+  }
+  client->size -= line - client->buf;
+  memmove(client->buf, line, client->size);
+  return 0;
+}
+
+static int open_socket(const char *socket_path, char is_listen) {
+  struct sockaddr_un addr;
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  memset(&addr, '\0', sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) goto err;
+  strcpy(addr.sun_path, socket_path);
+  if (is_listen) {
+    unlink(socket_path);  /* Left there by a previous daemon. */
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 64) != 0) goto err;
+  } else {
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) goto err;
+  }
+  return fd;
+ err:
+  close(fd);
+  return -1;
+}
+
+int daemon_run(const char *socket_path, char **dirs, uint32_t dir_count,
+               uint32_t thread_count, uint32_t flags,
+               emit_result_t emit_result) {
+  struct daemon dm;
+  struct pollfd pfds[3 + DAEMON_MAX_CLIENTS];
+  struct sockaddr_nl nl_addr;
+  struct client *client;
+  uint64_t buf_aligned[1024];  /* For struct inotify_event. */
+  char *buf = (char*)buf_aligned, **paths = 0, *p;
+  uint32_t i, path_count = 0, capacity = 0;
+  ssize_t got;
+  int listen_fd, uevent_fd, inotify_fd, fd;
+  memset(&dm, '\0', sizeof(dm));
+  dm.flags = flags;
+  dm.emit_result = emit_result;
+  dm.bucket_count = 256;
+  if (!(dm.buckets = (struct result**)calloc(dm.bucket_count,
+                                             sizeof(*dm.buckets)))) return 2;
+  if ((listen_fd = open_socket(socket_path, 1)) < 0) return 2;
+  /* Kernel uevents only (group 1). Fails without CAP_NET_ADMIN on some
+   * kernels, then there are no refreshes for block devices.
+   */
+  if ((uevent_fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT)
+      ) >= 0) {
+    memset(&nl_addr, '\0', sizeof(nl_addr));
+    nl_addr.nl_family = AF_NETLINK;
+    nl_addr.nl_groups = 1;
+    if (bind(uevent_fd, (struct sockaddr*)&nl_addr, sizeof(nl_addr)) != 0) {
+      close(uevent_fd);
+      uevent_fd = -1;
+    }
+  }
+  /* Subscribe before listing, so changes during the listing are seen. */
+  inotify_fd = inotify_init();
+  for (i = 0; i < dir_count; ++i) {  /* Make the paths match the queries. */
+    for (p = dirs[i] + strlen(dirs[i]); p > dirs[i] + 1 && p[-1] == '/'; --p) {
+      p[-1] = '\0';
+    }
+  }
+  for (i = 0; i < dir_count && inotify_fd >= 0 &&
+       dm.watch_count < DAEMON_MAX_WATCHES; ++i) {
+    if ((fd = inotify_add_watch(inotify_fd, dirs[i], IN_CLOSE_WRITE |
+        IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)) >= 0) {
+      dm.watches[dm.watch_count].wd = fd;
+      dm.watches[dm.watch_count++].dir = dirs[i];
+    }
+  }
+  list_dir("/dev", 0, &paths, &path_count, &capacity);
+  for (i = 0; i < dir_count; ++i) {
+    list_dir(dirs[i], 1, &paths, &path_count, &capacity);
+  }
+  detect_paths(&dm, paths, path_count, thread_count);
+  for (i = 0; i < path_count; ++i) {
+    free(paths[i]);
+  }
+  free(paths);
+  for (;;) {
+    pfds[0].fd = listen_fd;
+    pfds[1].fd = uevent_fd;  /* Ignored by poll if negative. */
+    pfds[2].fd = inotify_fd;
+    for (i = 0; i < dm.client_count; ++i) {
+      pfds[3 + i].fd = dm.clients[i]->fd;
+    }
+    for (i = 0; i < 3 + dm.client_count; ++i) {
+      pfds[i].events = POLLIN;
+      pfds[i].revents = 0;
+    }
+    if (poll(pfds, 3 + dm.client_count, -1) < 0) continue;  /* EINTR. */
+    if ((pfds[1].revents & POLLIN) &&
+        (got = recv(uevent_fd, buf, sizeof(buf_aligned) - 1, 0)) > 0) {
+      buf[got] = '\0';
+      handle_uevent(&dm, buf, got);
+    }
+    if ((pfds[2].revents & POLLIN) &&
+        (got = read(inotify_fd, buf, sizeof(buf_aligned))) > 0) {
+      handle_inotify(&dm, buf, got);
+    }
+    for (i = dm.client_count; i > 0; --i) {  /* Backwards for removal. */
+      if (pfds[2 + i].revents == 0) continue;
+      client = dm.clients[i - 1];
+      if (handle_client(&dm, client) != 0) {
+        close(client->fd);
+        free(client);
+        dm.clients[i - 1] = dm.clients[--dm.client_count];
+      }
+    }
+    if ((pfds[0].revents & POLLIN) && (fd = accept(listen_fd, 0, 0)) >= 0) {
+      if (dm.client_count == DAEMON_MAX_CLIENTS ||
+          !(client = (struct client*)malloc(sizeof(*client)))) {
+        close(fd);
+      } else {
+        client->fd = fd;
+        client->size = 0;
+        dm.clients[dm.client_count++] = client;
+      }
+    }
+  }
+}
+
+int daemon_query(const char *socket_path, char **paths, uint32_t path_count) {
+  char buf[8192];
+  ssize_t got;
+  uint32_t i, line_count = 0;
+  const int fd = open_socket(socket_path, 0);
+  if (fd < 0) return 2;
+  for (i = 0; i < path_count; ++i) {
+    if (strchr(paths[i], '\n')) return 1;
+    if (write(fd, paths[i], strlen(paths[i])) < 0 ||
+        write(fd, "\n", 1) != 1) return 2;
+  }
+  /* Copy the answers (one line per path) to stdout. */
+  while (line_count < path_count && (got = read(fd, buf, sizeof(buf))) > 0) {
+    for (i = 0; i < (uint32_t)got; ++i) {
+      line_count += buf[i] == '\n';
+    }
+    (void)!write(1, buf, got);
+  }
+  close(fd);
+  return line_count == path_count ? 0 : 2;
+}
@@ -0,0 +1,91 @@
+#define _GNU_SOURCE 1  /* For O_DIRECT. */
+#include "fsdetect_tool.h"
+
+#ifdef HAVE_DIRECT
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+
+unsigned char *direct_pool_alloc(void) {
+  void *pool;
+  return posix_memalign(&pool, DIRECT_ALIGN,
+                        DIRECT_BUF_COUNT * DIRECT_BUF_SIZE) == 0 ?
+      (unsigned char*)pool : 0;
+}
+
+int direct_open(const char *path) {
+  return open(path, O_RDONLY | O_DIRECT);
+}
+
+void direct_init(struct direct_reader *dr, int fd, unsigned char *pool) {
+  int sector_size;
+  memset(dr, '\0', sizeof(*dr));
+  dr->fd = fd;
+  dr->pool = pool;
+  dr->align = DIRECT_ALIGN;
+  /* Fails for regular files, where DIRECT_ALIGN is usually fine. */
+  if (ioctl(fd, BLKSSZGET, &sector_size) == 0 &&
+      sector_size > DIRECT_ALIGN && sector_size <= DIRECT_BUF_SIZE / 2 &&
+      (sector_size & (sector_size - 1)) == 0) {
+    dr->align = sector_size;
+  }
+}
+
+/* Returns the buffer containing ofs .. ofs + size - 1, reading it if
+ * needed. The range must fit to DIRECT_BUF_SIZE - dr->align bytes.
+ * Returns NULL on read error.
+ */
+static const struct direct_buf *get_buf(struct direct_reader *dr,
+                                        uint64_t ofs, uint32_t size) {
+  struct direct_buf *b, *lru = dr->bufs;
+  const uint64_t start = ofs & ~(uint64_t)(dr->align - 1);
+  uint64_t end = (ofs + size + dr->align - 1) & ~(uint64_t)(dr->align - 1);
+  ssize_t got;
+  for (b = dr->bufs; b != dr->bufs + DIRECT_BUF_COUNT; ++b) {
+    if (b->size != 0 && ofs >= b->ofs && ofs + size <= b->ofs + b->size) {
+      b->last_use = ++dr->use_count;
+      return b;
+    }
+    if (b->last_use < lru->last_use) lru = b;
+  }
+  /* Also read the aligned sectors after it, up to the next 64 KiB, e.g.
+   * the second half of the Btrfs superblock.
+   */
+  if (end - start < DIRECT_BUF_SIZE &&
+      (start & (DIRECT_BUF_SIZE - 1)) + (end - start) <= DIRECT_BUF_SIZE) {
+    end = (start | (DIRECT_BUF_SIZE - 1)) + 1;
+  }
+  lru->size = 0;
+  got = pread(dr->fd, dr->pool + (lru - dr->bufs) * DIRECT_BUF_SIZE,
+              end - start, start);
+  /* A short read at the end of the device is fine. */
+  if (got < 0 || (uint64_t)got < ofs + size - start) return 0;
+  lru->ofs = start;
+  lru->size = got;
+  lru->last_use = ++dr->use_count;
+  return lru;
+}
+
+int direct_read_block(void *dr_ptr, uint64_t block_idx,
+                      uint32_t block_count, void *buf) {
+  struct direct_reader *dr = (struct direct_reader*)dr_ptr;
+  const struct direct_buf *b;
+  unsigned char *p = (unsigned char*)buf;
+  uint64_t ofs = block_idx << 9;
+  uint32_t size = block_count << 9, part_size;
+  for (; size > 0; p += part_size, ofs += part_size, size -= part_size) {
+    /* The aligned range around the part fits to a buffer. */
+    part_size = DIRECT_BUF_SIZE - dr->align -
+        (uint32_t)(ofs & (dr->align - 1));
+    if (part_size > size) part_size = size;
+    if (!(b = get_buf(dr, ofs, part_size))) {
+      memset(buf, '\0', (size_t)block_count << 9);
+      return -1;
+    }
+    memcpy(p, dr->pool + (b - dr->bufs) * DIRECT_BUF_SIZE + (ofs - b->ofs),
+           part_size);
+  }
+  return 0;
+}
+#endif
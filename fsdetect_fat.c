@@ -90,65 +90,67 @@ struct AssertFsi512BytesStruct {
 
 static const char no_name[] = "NO NAME    ";
 
-int fsdetect_fat(read_block_t read_block, void *read_block_data,
+int fsdetect_fat(const struct fsdetect_reader *rd,
                  struct fsdetect_output *fsdo) {
-  struct fat_super_block sb;
+  struct fat_super_block sb_buf;
+  const struct fat_super_block *sb;
   uint16_t sector_size, dir_entries, reserved;
   uint32_t sect_count, fat_size, dir_size, cluster_count, fat_length;
   uint32_t max_count;
   uint8_t fat_bits;
   uint16_t fsinfo_sect;
   const unsigned char *vol_label = 0;
-  unsigned char *vol_serno = 0;
-
-  if (read_block(read_block_data, 0, 1, &sb) != 0) return 10;
-  if (!(sb.ms_jump[0] == (unsigned char)'\xeb' && sb.ms_jump[2] == (unsigned char)'\x90') &&
-      !(sb.ms_jump[0] == (unsigned char)'\xe9' && sb.ms_jump[2] <= 1)) return 11;
-  if ((0 != memcmp(sb.fat.f32.magic, "FAT32   ", 8) ||
-       0 != memcmp(sb.fat.f32.magic, "MSWIN4.0", 8) ||
-       0 != memcmp(sb.fat.f32.magic, "MSWIN4.1", 8)) &&
-      sb.fat.f32.signature == 0x29  /* can be 0x28 */
+  const unsigned char *vol_serno = 0;
+
+  if (!(sb = (const struct fat_super_block*)get_blocks(
+      rd, FAT_SB_BLOCK, 1, &sb_buf))) return 10;
+  if (!(sb->ms_jump[0] == (unsigned char)'\xeb' && sb->ms_jump[2] == (unsigned char)'\x90') &&
+      !(sb->ms_jump[0] == (unsigned char)'\xe9' && sb->ms_jump[2] <= 1)) return 11;
+  if ((0 != memcmp(sb->fat.f32.magic, "FAT32   ", 8) ||
+       0 != memcmp(sb->fat.f32.magic, "MSWIN4.0", 8) ||
+       0 != memcmp(sb->fat.f32.magic, "MSWIN4.1", 8)) &&
+      sb->fat.f32.signature == 0x29  /* can be 0x28 */
      ) {
     fat_bits = 32;
     strcpy(fsdo->fstype, "fat32");
     max_count = FAT32_MAX;
-  } else if (sb.fat.f1x.signature != 0x29) {  /* MS-DOS >=4.0 */
+  } else if (sb->fat.f1x.signature != 0x29) {  /* MS-DOS >=4.0 */
     return 12;
-  } else if (0 == memcmp(sb.fat.f1x.magic, "FAT12   ", 8)) {
+  } else if (0 == memcmp(sb->fat.f1x.magic, "FAT12   ", 8)) {
     fat_bits = 12;
     strcpy(fsdo->fstype, "fat12");
     max_count = FAT12_MAX;
-  } else if (0 == memcmp(sb.fat.f1x.magic, "FAT16   ", 8)) {
+  } else if (0 == memcmp(sb->fat.f1x.magic, "FAT16   ", 8)) {
     fat_bits = 16;
     strcpy(fsdo->fstype, "fat16");
     max_count = FAT16_MAX;
-  } else if (0 == memcmp(sb.fat.f1x.magic, "MSDOS   ", 8)) {
+  } else if (0 == memcmp(sb->fat.f1x.magic, "MSDOS   ", 8)) {
     fat_bits = 126;  /* We'll figure it out later. */
     strcpy(fsdo->fstype, "fat12");
     max_count = FAT12_MAX;
   } else {
     return 13;
   }
-  reserved = le16(sb.ms_reserved);
-  dir_entries = unaligned_le16(sb.ms_root_entries);
-  sect_count = unaligned_le16(sb.ms_sectors);
+  reserved = le16(sb->ms_reserved);
+  dir_entries = unaligned_le16(sb->ms_root_entries);
+  sect_count = unaligned_le16(sb->ms_sectors);
   if (sect_count == 0)
-    sect_count = le32(sb.ms_total_sect);
+    sect_count = le32(sb->ms_total_sect);
 
-  if (sb.ms_fats - 1U > 2 - 1U)  /* NTFS has 0 here. */
+  if (sb->ms_fats - 1U > 2 - 1U)  /* NTFS has 0 here. */
     return 14;
   if (!reserved)  /* NTFS has 0 here. */
     return 15;
-  if (!(0xf8 <= sb.ms_media || sb.ms_media == 0xf0))
+  if (!(0xf8 <= sb->ms_media || sb->ms_media == 0xf0))
     return 16;
-  if (!is_power_of_2(sb.ms_cluster_size))
+  if (!is_power_of_2(sb->ms_cluster_size))
     return 17;
   if (fat_bits != 32 && dir_entries == 0)
     return 31;
-  if (le16(sb.ms_boot_signature) != 0xaa55)
+  if (le16(sb->ms_boot_signature) != 0xaa55)
     return 33;
 
-  sector_size = unaligned_le16(sb.ms_sector_size);
+  sector_size = unaligned_le16(sb->ms_sector_size);
   switch (sector_size) {
    case 512: case 1024: case 2048: case 4096:
    case 8192: case 16384: case 32768:
@@ -161,22 +163,22 @@ int fsdetect_fat(read_block_t read_block, void *read_block_data,
     return 32;
 */
 
-  fat_length = le16(sb.ms_fat_length);
+  fat_length = le16(sb->ms_fat_length);
   if (fat_length == 0) {
     if (fat_bits != 32) return 19;
-    fat_length = le32(sb.fat.f32.fat32_length);
+    fat_length = le32(sb->fat.f32.fat32_length);
   }
 
-  fat_size = fat_length * sb.ms_fats;
+  fat_size = fat_length * sb->ms_fats;
   dir_size = ((dir_entries * 32) +
           (sector_size-1)) / sector_size;
 
   cluster_count = sect_count - (reserved + fat_size + dir_size);
   if ((int32_t)cluster_count <= 0) return 24;
 #if 0  /* TODO(pts): Are there any unused sectors in the end? */
-  if (cluster_count % sb.ms_cluster_size != 0) return 25;
+  if (cluster_count % sb->ms_cluster_size != 0) return 25;
 #endif
-  cluster_count /= sb.ms_cluster_size;
+  cluster_count /= sb->ms_cluster_size;
   if (fat_bits == 126) {
     if (cluster_count > FAT12_MAX) {
       fat_bits = 16;
@@ -194,28 +196,30 @@ int fsdetect_fat(read_block_t read_block, void *read_block_data,
     /* There is also a label in the root directory, but we use the one in
      * the boot sector, for simplicity.
      */
-    vol_label = sb.fat.f1x.label;
-    vol_serno = sb.fat.f1x.serno;
+    vol_label = sb->fat.f1x.label;
+    vol_serno = sb->fat.f1x.serno;
   } else {
-    vol_label = sb.fat.f32.label;
-    vol_serno = sb.fat.f32.serno;
+    vol_label = sb->fat.f32.label;
+    vol_serno = sb->fat.f32.serno;
     /*
      * FAT32 should have a valid signature in the fsinfo block,
      * but also allow all bytes set to '\0', because some volumes
      * do not set the signature at all.
      */
-    fsinfo_sect = le16(sb.fat.f32.fsinfo_sector);
+    fsinfo_sect = le16(sb->fat.f32.fsinfo_sector);
     if (fsinfo_sect) {
-      struct fat32_fsinfo fsinfo;
-      if (read_block(read_block_data, fsinfo_sect * (sector_size >> 9), 1, &fsinfo) != 0) return 21;
+      struct fat32_fsinfo fsinfo_buf;
+      const struct fat32_fsinfo *fsinfo;
+      if (!(fsinfo = (const struct fat32_fsinfo*)get_blocks(
+          rd, fsinfo_sect * (sector_size >> 9), 1, &fsinfo_buf))) return 21;
       /* buggy mkfs.vfat -C creates a copy of the boot sector here. */
-      if (0 != memcmp(fsinfo.signature1, "\xeb\x58\x90", 3)) {
-        if (memcmp(fsinfo.signature1, "\x52\x52\x61\x41", 4) != 0 &&
-            memcmp(fsinfo.signature1, "\x52\x52\x64\x41", 4) != 0 &&
-            memcmp(fsinfo.signature1, "\x00\x00\x00\x00", 4) != 0)
+      if (0 != memcmp(fsinfo->signature1, "\xeb\x58\x90", 3)) {
+        if (memcmp(fsinfo->signature1, "\x52\x52\x61\x41", 4) != 0 &&
+            memcmp(fsinfo->signature1, "\x52\x52\x64\x41", 4) != 0 &&
+            memcmp(fsinfo->signature1, "\x00\x00\x00\x00", 4) != 0)
           return 22;
-        if (memcmp(fsinfo.signature2, "\x72\x72\x41\x61", 4) != 0 &&
-            memcmp(fsinfo.signature2, "\x00\x00\x00\x00", 4) != 0)
+        if (memcmp(fsinfo->signature2, "\x72\x72\x41\x61", 4) != 0 &&
+            memcmp(fsinfo->signature2, "\x00\x00\x00\x00", 4) != 0)
           return 23;
       }
     }
@@ -0,0 +1,205 @@
+#include "fsdetect_tool.h"
+
+/* The first STREAM_PREFIX_SIZE bytes of the stream are kept, they cover
+ * the superblocks of all probes (the Btrfs one ends at 68 KiB).
+ */
+#define STREAM_PREFIX_SIZE (128 << 10)
+
+/* Forward-only reader of a stream. On the stack of stream_detect, so it
+ * takes memory only when stdin is a pipe (not .bss in every build).
+ */
+struct stream {
+  unsigned char prefix[STREAM_PREFIX_SIZE];
+  /* Ranges after the prefix (e.g. the NTFS MFT records) are read here. */
+  unsigned char pool[FSDETECT_SCRATCH_SIZE];
+  unsigned char discard[65536];  /* For skipping forward. */
+  uint64_t pos;  /* Bytes consumed from the stream. */
+  uint32_t pool_used;
+  char is_error;  /* EOF or read error. */
+};
+
+/* Reads size bytes to buf (or discards them if buf is NULL). Returns
+ * nonzero on EOF or read error, and then it doesn't read again.
+ */
+static int stream_read(struct stream *stream, int fd, unsigned char *buf,
+                       uint64_t size) {
+  ssize_t got;
+  while (size > 0 && !stream->is_error) {
+    if ((got = read(fd, buf ? buf : stream->discard,
+                    size > sizeof(stream->discard) ?
+                    sizeof(stream->discard) : (size_t)size)) <= 0) {
+      stream->is_error = 1;
+    } else {
+      size -= got;
+      stream->pos += got;
+      if (buf) buf += got;
+    }
+  }
+  return stream->is_error;
+}
+
+/* Fetches range r: from the prefix, or to the pool, after skipping forward
+ * to it. A range behind stream->pos (and beyond the prefix) can't be read
+ * anymore.
+ */
+static void stream_fetch(struct stream *stream, int fd,
+                         uint64_t limit_block_count,
+                         struct fsdetect_range *r) {
+  const uint64_t ofs = r->block_idx << 9;
+  uint64_t size = (uint64_t)r->block_count << 9;
+  unsigned char *dst;
+  r->data = 0;
+  r->result = -1;
+  if (r->block_idx > limit_block_count ||
+      r->block_count > limit_block_count - r->block_idx) return;
+  if (ofs + size <= STREAM_PREFIX_SIZE) {
+    if (stream->pos < ofs + size &&
+        stream_read(stream, fd, stream->prefix + stream->pos,
+                    ofs + size - stream->pos)) return;
+    r->data = stream->prefix + ofs;
+  } else if (stream->pos <= (ofs > STREAM_PREFIX_SIZE ? ofs :
+                             STREAM_PREFIX_SIZE) &&
+             size <= sizeof(stream->pool) - stream->pool_used) {
+    r->data = dst = stream->pool + stream->pool_used;
+    stream->pool_used += size;
+    if (stream->pos < STREAM_PREFIX_SIZE &&
+        stream_read(stream, fd, stream->prefix + stream->pos,
+                    STREAM_PREFIX_SIZE - stream->pos)) goto err;
+    if (ofs < STREAM_PREFIX_SIZE) {  /* Starts in the prefix. */
+      memcpy(dst, stream->prefix + ofs, STREAM_PREFIX_SIZE - ofs);
+      dst += STREAM_PREFIX_SIZE - ofs;
+      size -= STREAM_PREFIX_SIZE - ofs;
+    } else if (stream_read(stream, fd, 0, ofs - stream->pos)) {
+      goto err;
+    }
+    if (stream_read(stream, fd, dst, size)) { err:
+      r->data = 0;
+      return;
+    }
+  } else {
+    return;
+  }
+  r->result = 0;
+}
+
+void stream_detect(int fd, uint64_t limit_block_count,
+                   const struct fsdetect_args *args,
+                   struct fsdetect_output *fsdo) {
+  struct stream stream;
+  struct fsdetect_async fa;
+  struct fsdetect_range *sorted[FSDETECT_ASYNC_RANGE_COUNT], *r;
+  uint32_t new_count, i, j;
+  stream.pos = 0;
+  stream.pool_used = 0;
+  stream.is_error = 0;
+  fsdetect_async_init(&fa, args);
+  while ((new_count = fsdetect_async_step(&fa, fsdo)) != 0) {
+    /* Insertion sort, so that the reads go forward. */
+    for (i = 0; i < new_count; ++i) {
+      r = fa.ranges + fa.range_count - new_count + i;
+      for (j = i; j > 0 && sorted[j - 1]->block_idx > r->block_idx; --j) {
+        sorted[j] = sorted[j - 1];
+      }
+      sorted[j] = r;
+    }
+    for (i = 0; i < new_count; ++i) {
+      stream_fetch(&stream, fd, limit_block_count, sorted[i]);
+    }
+  }
+}
+
+#ifdef HAVE_BATCH
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+/* Appends dir/name (malloc()ed) to *paths. */
+static void add_path(char ***paths, uint32_t *path_count,
+                     uint32_t *capacity, const char *dir, const char *name) {
+  char *path, **new_paths;
+  if (*path_count == *capacity) {
+    if (!(new_paths = (char**)realloc(
+        *paths, (*capacity = *capacity * 2 + 16) * sizeof(**paths)))) return;
+    *paths = new_paths;
+  }
+  if (!(path = (char*)malloc(strlen(dir) + strlen(name) + 2))) return;
+  strcpy(path, dir);
+  strcat(path, "/");
+  strcat(path, name);
+  (*paths)[(*path_count)++] = path;
+}
+
+void list_dir(const char *dir, char is_files, char ***paths,
+                     uint32_t *path_count, uint32_t *capacity) {
+  DIR *d = opendir(is_files ? dir : "/sys/class/block");
+  struct dirent *de;
+  struct stat st;
+  char buf[4096];
+  if (!d) return;
+  while ((de = readdir(d))) {
+    if (de->d_name[0] == '.') continue;
+    if (is_files) {
+      if (strlen(dir) + strlen(de->d_name) + 2 > sizeof(buf)) continue;
+      strcpy(buf, dir);
+      strcat(buf, "/");
+      strcat(buf, de->d_name);
+      if (stat(buf, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+    }
+    add_path(paths, path_count, capacity, dir, de->d_name);
+  }
+  closedir(d);
+}
+
+/* Reads all data from fd to a NUL-terminated, malloc()ed buffer. */
+char *read_all(int fd, size_t *size_out) {
+  size_t size = 0, capacity = 4096;
+  ssize_t got;
+  char *buf = (char*)malloc(capacity + 1), *new_buf;
+  if (!buf) return 0;
+  for (;;) {
+    if (size == capacity) {
+      if (!(new_buf = (char*)realloc(buf, (capacity <<= 1) + 1))) break;
+      buf = new_buf;
+    }
+    if ((got = read(fd, buf + size, capacity - size)) <= 0) {
+      if (got < 0) break;
+      buf[size] = '\0';
+      *size_out = size;
+      return buf;
+    }
+    size += got;
+  }
+  free(buf);
+  return 0;
+}
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int mmap_file_open(struct mmap_file *mf, int fd) {
+  struct stat st;
+  void *base;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+      (uint64_t)st.st_size != (size_t)st.st_size) return -1;
+  base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) return -1;
+  mf->base = (const unsigned char*)base;
+  mf->size = st.st_size;
+  return 0;
+}
+
+void mmap_file_close(struct mmap_file *mf) {
+  munmap((void*)mf->base, mf->size);
+}
+
+const void *mmap_map_block(void *mf_ptr, uint64_t block_idx,
+                           uint32_t block_count) {
+  const struct mmap_file *mf = (const struct mmap_file*)mf_ptr;
+  /* Only whole blocks, like fsdetect_fd_read_block. */
+  if (block_idx >= mf->size >> 9 || block_count > (mf->size >> 9) - block_idx
+     ) return 0;
+  return mf->base + (block_idx << 9);
+}
+#endif
@@ -0,0 +1,105 @@
+#include "fsdetect_impl.h"
+
+/* The fields a fingerprint covers, for each filesystem type. Offsets are
+ * relative to the first block of the fingerprint.
+ */
+struct fingerprint_spec {
+  char fstype_prefix[6];
+  uint8_t prefix_size;
+  uint8_t block_count;
+  uint64_t block_idx;
+  struct { uint16_t ofs, size; } ranges[3];
+};
+
+static const struct fingerprint_spec specs[] = {
+    /* Jump, OEM ID, BPB and extended BPB (serial and label) of FAT12,
+     * FAT16 and FAT32, boot signature.
+     */
+    { "fat", 3, 1, FAT_SB_BLOCK, { { 0, 0x5a }, { 0x1fe, 2 }, { 0, 0 } } },
+    /* s_mtime, s_wtime, mount counts, s_magic, s_state; features, s_uuid,
+     * s_volume_name.
+     */
+    { "ext", 3, 1, EXT_SB_BLOCK, { { 0x2c, 0x10 }, { 0x5c, 0x2c }, { 0, 0 } } },
+    /* OEM ID, BPB, MFT location, serial; boot signature. The label is in
+     * the MFT, it's not covered.
+     */
+    { "ntfs", 4, 1, NTFS_SB_BLOCK, { { 0, 0x54 }, { 0x1fe, 2 }, { 0, 0 } } },
+    /* fsid; magic, generation; label. */
+    { "btrfs", 5, 2, BTRFS_SB_BLOCK,
+      { { 0x20, 0x10 }, { 0x40, 0x10 }, { 0x12b, 0x100 } } } };
+
+static const struct fingerprint_spec *find_spec(const char *fstype) {
+  const struct fingerprint_spec *spec;
+  for (spec = specs; spec != specs + sizeof(specs) / sizeof(specs[0]);
+       ++spec) {
+    if (0 == memcmp(fstype, spec->fstype_prefix, spec->prefix_size)
+       ) return spec;
+  }
+  return 0;
+}
+
+/* FNV-1a. */
+static uint64_t hash_bytes(uint64_t hash, const unsigned char *p,
+                           size_t size) {
+  for (; size > 0; --size) {
+    hash = (hash ^ *p++) * (((uint64_t)0x100 << 32) | 0x1b3);
+  }
+  return hash;
+}
+
+/* Reads the fingerprint blocks of fsdo, and computes the fingerprint.
+ * Returns nonzero if fsdo has no fingerprint or on read error.
+ */
+static int compute(const struct fsdetect_args *args,
+                   const struct fsdetect_output *fsdo,
+                   struct fsdetect_fingerprint *fp) {
+  unsigned char buf[1024];
+  const unsigned char *blocks;
+  const struct fingerprint_spec *spec = find_spec(fsdo->fstype);
+  uint64_t hash = ((uint64_t)0xcbf29ce4 << 32) | 0x84222325;
+  const char *p;
+  uint32_t i;
+  if (!spec) return -1;
+  if (args->map_block) {
+    if (!(blocks = (const unsigned char*)args->map_block(
+        args->read_block_data, spec->block_idx, spec->block_count))
+       ) return -1;
+  } else if (args->read_block64) {
+    if (args->read_block64(args->read_block_data, spec->block_idx,
+                           spec->block_count, buf) != 0) return -1;
+    blocks = buf;
+  } else {
+    if (args->read_block(args->read_block_data, (uint32_t)spec->block_idx,
+                         spec->block_count, buf) != 0) return -1;
+    blocks = buf;
+  }
+  /* A different fstype (e.g. ext3 to ext4) doesn't match. */
+  for (p = fsdo->fstype; *p != '\0'; ++p) {}
+  hash = hash_bytes(hash, (const unsigned char*)fsdo->fstype,
+                    p - fsdo->fstype);
+  for (i = 0; i < sizeof(spec->ranges) / sizeof(spec->ranges[0]); ++i) {
+    hash = hash_bytes(hash, blocks + spec->ranges[i].ofs,
+                      spec->ranges[i].size);
+  }
+  fp->block_idx = spec->block_idx;
+  fp->block_count = spec->block_count;
+  fp->hash = hash;
+  return 0;
+}
+
+int fsdetect_fingerprint(const struct fsdetect_args *args,
+                         const struct fsdetect_output *fsdo,
+                         struct fsdetect_fingerprint *fp) {
+  memset(fp, '\0', sizeof(*fp));
+  return compute(args, fsdo, fp);
+}
+
+int fsdetect_revalidate(const struct fsdetect_args *args,
+                        const struct fsdetect_output *fsdo,
+                        const struct fsdetect_fingerprint *fp) {
+  struct fsdetect_fingerprint new_fp;
+  if (fp->block_count == 0 || compute(args, fsdo, &new_fp) != 0 ||
+      new_fp.block_idx != fp->block_idx || new_fp.hash != fp->hash
+     ) return -1;
+  return 0;
+}
@@ -78,13 +78,205 @@ static __inline__ char is_less_hilo(uint32_t ahi, uint32_t alo,
   return ahi < bhi || (ahi == bhi && alo < blo);
 }
 
-int fsdetect_ext(read_block_t read_block, void *read_block_data,
+/* Reads a little endian uint32_t at any alignment. */
+static __inline__ uint32_t get_le32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* USDT (SystemTap SDT) probe points for perf and bpftrace, e.g.
+ *
+ *   bpftrace -e 'usdt:./fsdetect:fsdetect:probe__done {
+ *       printf("%s %d\n", str(arg0), arg1); }'
+ *
+ * Each one compiles to a nop instruction and an ELF note, plus keeping its
+ * arguments in registers. Without <sys/sdt.h> (or with -DFSDETECT_NO_SDT)
+ * they compile to nothing, -DFSDETECT_SDT (make SDT=1) makes the build
+ * fail instead. See README.txt for the list.
+ */
+#ifdef FSDETECT_NO_SDT
+#elif defined(FSDETECT_SDT)
+#if defined(__XTINY__) || defined(__TINYC__)
+#error FSDETECT_SDT is not supported in the xtiny and tcc builds.
+#endif
+#include <sys/sdt.h>  /* From systemtap-sdt-dev. */
+#define FSDETECT_HAVE_SDT 1
+#elif !defined(__XTINY__) && !defined(__TINYC__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define FSDETECT_HAVE_SDT 1
+#endif
+#endif
+#ifdef FSDETECT_HAVE_SDT
+#define FSDETECT_TRACE1(name, a) DTRACE_PROBE1(fsdetect, name, a)
+#define FSDETECT_TRACE2(name, a, b) DTRACE_PROBE2(fsdetect, name, a, b)
+#define FSDETECT_TRACE3(name, a, b, c) DTRACE_PROBE3(fsdetect, name, a, b, c)
+#else
+#define FSDETECT_TRACE1(name, a) do {} while (0)
+#define FSDETECT_TRACE2(name, a, b) do {} while (0)
+#define FSDETECT_TRACE3(name, a, b, c) do {} while (0)
+#endif
+
+/* Where the probes get their blocks from. */
+struct fsdetect_reader {
+  map_block_t map_block;  /* If NULL, read_block is used. */
+  read_block64_t read_block;
+  void *data;
+  struct fsdetect_probe_stats *stats;  /* Can be NULL. */
+  unsigned char *scratch;  /* Can be NULL. */
+  uint32_t scratch_size;
+  uint32_t flags;  /* fsdetect_args.flags. */
+  struct fsdetect_btrfs_info *btrfs_info;  /* Can be NULL. */
+};
+
+/* Returns a pointer to block_count blocks starting at block_idx: the
+ * mapped data (without copying) or buf (after reading to it). Returns NULL
+ * on error.
+ */
+static __inline__ const void *get_blocks(const struct fsdetect_reader *rd,
+                                         uint64_t block_idx,
+                                         uint32_t block_count, void *buf) {
+  if (rd->stats) {
+    ++rd->stats->read_count;
+    rd->stats->byte_count += (uint64_t)block_count << 9;
+  }
+  if (rd->map_block) {
+    buf = (void*)rd->map_block(rd->data, block_idx, block_count);
+    FSDETECT_TRACE3(map__done, block_idx, block_count, buf ? 0 : -1);
+    return buf;
+  }
+  return rd->read_block(rd->data, block_idx, block_count, buf) == 0 ? buf : 0;
+}
+
+/* The block each probe reads unconditionally (first). The read plan in
+ * fsdetect_ex prefetches these.
+ */
+#define FAT_SB_BLOCK 0
+#define EXT_SB_BLOCK 2  /* 0x400. */
+#define NTFS_SB_BLOCK 0
+#define BTRFS_SB_BLOCK 128  /* 0x10000. */
+
+/* Bits in a probe mask. */
+#define FSDETECT_PROBE_FAT 1
+#define FSDETECT_PROBE_EXT 2
+#define FSDETECT_PROBE_NTFS 4
+#define FSDETECT_PROBE_BTRFS 8
+#define FSDETECT_PROBE_ALL 15
+
+/* Compile-time probe selection, e.g. -DFSDETECT_ENABLE_EXT
+ * -DFSDETECT_ENABLE_FAT. If none of the FSDETECT_ENABLE_... macros is
+ * defined, all probes are compiled in. The sources of the other probes
+ * needn't be linked.
+ */
+#if !defined(FSDETECT_ENABLE_FAT) && !defined(FSDETECT_ENABLE_EXT) && \
+    !defined(FSDETECT_ENABLE_NTFS) && !defined(FSDETECT_ENABLE_BTRFS)
+#define FSDETECT_ENABLE_FAT 1
+#define FSDETECT_ENABLE_EXT 1
+#define FSDETECT_ENABLE_NTFS 1
+#define FSDETECT_ENABLE_BTRFS 1
+#endif
+
+#ifdef FSDETECT_ENABLE_FAT
+#define FSDETECT_ENABLED_FAT 1
+#else
+#define FSDETECT_ENABLED_FAT 0
+#endif
+#ifdef FSDETECT_ENABLE_EXT
+#define FSDETECT_ENABLED_EXT 1
+#else
+#define FSDETECT_ENABLED_EXT 0
+#endif
+#ifdef FSDETECT_ENABLE_NTFS
+#define FSDETECT_ENABLED_NTFS 1
+#else
+#define FSDETECT_ENABLED_NTFS 0
+#endif
+#ifdef FSDETECT_ENABLE_BTRFS
+#define FSDETECT_ENABLED_BTRFS 1
+#else
+#define FSDETECT_ENABLED_BTRFS 0
+#endif
+
+/* Mask of the compiled-in probes. */
+#define FSDETECT_PROBE_ENABLED ( \
+    FSDETECT_ENABLED_FAT * FSDETECT_PROBE_FAT | \
+    FSDETECT_ENABLED_EXT * FSDETECT_PROBE_EXT | \
+    FSDETECT_ENABLED_NTFS * FSDETECT_PROBE_NTFS | \
+    FSDETECT_ENABLED_BTRFS * FSDETECT_PROBE_BTRFS)
+
+/* The read plan: sorted, unique list of the *_SB_BLOCK of the compiled-in
+ * probes, as an initializer.
+ */
+#if FSDETECT_ENABLED_FAT || FSDETECT_ENABLED_NTFS
+#define FSDETECT_PLAN_FAT FAT_SB_BLOCK,
+#else
+#define FSDETECT_PLAN_FAT
+#endif
+#if FSDETECT_ENABLED_EXT
+#define FSDETECT_PLAN_EXT EXT_SB_BLOCK,
+#else
+#define FSDETECT_PLAN_EXT
+#endif
+#if FSDETECT_ENABLED_BTRFS
+#define FSDETECT_PLAN_BTRFS BTRFS_SB_BLOCK,
+#else
+#define FSDETECT_PLAN_BTRFS
+#endif
+#define FSDETECT_PLAN_BLOCK_IDXS \
+    { FSDETECT_PLAN_FAT FSDETECT_PLAN_EXT FSDETECT_PLAN_BTRFS }
+#define FSDETECT_PLAN_BLOCK_COUNT ( \
+    (FSDETECT_ENABLED_FAT | FSDETECT_ENABLED_NTFS) + FSDETECT_ENABLED_EXT + \
+    FSDETECT_ENABLED_BTRFS)
+
+/* Checks the magic bytes of all probes at once, in the blocks FAT_SB_BLOCK
+ * (== NTFS_SB_BLOCK), EXT_SB_BLOCK and BTRFS_SB_BLOCK. A NULL block means
+ * it couldn't be read. Returns the mask of probes whose signatures match.
+ * It's a superset of the probes which would succeed.
+ */
+uint32_t fsdetect_prefilter(const unsigned char *block0,
+                            const unsigned char *block2,
+                            const unsigned char *block128);
+
+/* Number of 512-byte blocks in the block cache. fsdetect reads block 0
+ * twice (FAT and NTFS), and only a few other blocks once.
+ */
+#define FSDETECT_CACHE_SIZE 8
+
+struct fsdetect_cache {
+  read_block64_t read_block;
+  void *read_block_data;
+  uint32_t used_count;  /* Number of valid entries in block_idxs. */
+  uint32_t next_idx;  /* Entry to be overwritten next (round robin). */
+  struct fsdetect_cache_stats stats;
+  uint64_t block_idxs[FSDETECT_CACHE_SIZE];
+  unsigned char blocks[FSDETECT_CACHE_SIZE][512];
+};
+
+void fsdetect_cache_init(struct fsdetect_cache *cache,
+                         read_block64_t read_block, void *read_block_data);
+/* Prefetches blocks to an empty cache, using a single read_block_list
+ * call. block_count must be at most FSDETECT_CACHE_SIZE.
+ */
+int fsdetect_cache_read_block_list(struct fsdetect_cache *cache,
+                                   read_block_list_t read_block_list,
+                                   void *read_block_list_data,
+                                   const uint64_t *block_idxs,
+                                   uint32_t block_count);
+/* Returns the cached block_idx, or NULL. The pointer is valid until the
+ * next read.
+ */
+const unsigned char *fsdetect_cache_find(const struct fsdetect_cache *cache,
+                                         uint64_t block_idx);
+/* Compatible with read_block64_t, pass a struct fsdetect_cache* as fd_ptr. */
+int fsdetect_cache_read_block(void *cache_ptr, uint64_t block_idx,
+                              uint32_t block_count, void *buf);
+
+int fsdetect_ext(const struct fsdetect_reader *rd,
                  struct fsdetect_output *fsdo);
-int fsdetect_ntfs(read_block_t read_block, void *read_block_data,
+int fsdetect_ntfs(const struct fsdetect_reader *rd,
                   struct fsdetect_output *fsdo);
-int fsdetect_fat(read_block_t read_block, void *read_block_data,
+int fsdetect_fat(const struct fsdetect_reader *rd,
                  struct fsdetect_output *fsdo);
-int fsdetect_btrfs(read_block_t read_block, void *read_block_data,
+int fsdetect_btrfs(const struct fsdetect_reader *rd,
                    struct fsdetect_output *fsdo);
 
 #endif /* _FSDETECT_IMPL_H */
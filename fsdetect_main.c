@@ -2,28 +2,10 @@
  * fs.fat16: SEC_TYPE="msdos" LABEL="mylabel" UUID="EABC-AF1F" TYPE="vfat" 
  */
 
-/* No need for this, we don't seek too far: #define _FILE_OFFSET_BITS 64 */
-#ifdef __XTINY__
-#include <xtiny.h>
-#else
-#ifdef __TINYC__
-typedef long off_t;
-typedef unsigned int size_t;
-typedef int ssize_t;
-extern off_t lseek(int __fd, off_t __offset, int __whence) __attribute__ ((__nothrow__));
-extern void *memset(void *__s, int __c, size_t __n) __attribute__ ((__nothrow__)) __attribute__ ((__nonnull__ (1)));
-extern ssize_t read(int __fd, void *__buf, size_t __nbytes) ;
-extern size_t strlen(__const char *__s) __attribute__ ((__nothrow__)) __attribute__ ((__pure__)) __attribute__ ((__nonnull__ (1)));
-extern void *memcpy(void *__restrict __dest, __const void *__restrict __src, size_t __n) __attribute__ ((__nothrow__)) __attribute__ ((__nonnull__ (1, 2)));
-extern ssize_t write(int __fd, __const void *__buf, size_t __n) ;
-#define SEEK_SET 0
-#else
-#include <string.h>
-#include <sys/types.h>
-#include <unistd.h>
-#endif
+#include "fsdetect_tool.h"
+#ifdef HAVE_BATCH
+#include <stdlib.h>
 #endif
-#include "fsdetect.h"
 
 #if defined(__i386) || defined(__amd64)
 #define REGPARM3 __attribute__((regparm(3)))
@@ -31,19 +13,6 @@ extern ssize_t write(int __fd, __const void *__buf, size_t __n) ;
 #define REGPARM3
 #endif
 
-static int fd_read_block(void *fd_ptr, uint32_t block_idx,
-                         uint32_t block_count, void *buf) {
-  const off_t ofs = (off_t)block_idx << 9;
-  const size_t size = (size_t)block_count << 9;
-  const int fd = (size_t)fd_ptr;
-  if (ofs != lseek(fd, ofs, SEEK_SET)) { err:
-    memset(buf, '\0', size);
-    return -1;
-  }
-  if (size != (size_t)read(fd, buf, size)) goto err;
-  return 0;
-}
-
 REGPARM3 static __inline__ char *emit_char(char *p, char c) {
   *p++ = c;
   return p;
@@ -66,26 +35,618 @@ REGPARM3 static char *emit_hex(char *p, const char *bin, size_t size, char is_uc
   return p;
 }
 
-int main(int argc, char **argv) {
-  struct fsdetect_output fsdo;
-  char outbuf[256], *p = outbuf;
-
-  (void)argc; (void)argv;
-  fsdetect(fd_read_block, (void*)0  /* stdin */, &fsdo);
-  /* fsdo.fstype can be "?", fsdo.label can be empty, fsdo.uuid_size can be 0. */
-  p = emit_asciiz(emit_asciiz(emit_asciiz(emit_asciiz(emit_asciiz(p, "fstype="), fsdo.fstype), "\nlabel="), fsdo.label), "\nuuid=");
-  if (fsdo.uuid_size == 0) {
+/* Emits fsdo->uuid in the usual format of the filesystem type. */
+REGPARM3 static char *emit_uuid(char *p, const struct fsdetect_output *fsdo) {
+  if (fsdo->uuid_size == 0) {
     p = emit_char(p, '?');
-  } else if (fsdo.uuid_size == 4) {  /* FAT. */
-    p = emit_hex(emit_char(emit_hex(p, (const char*)fsdo.uuid, 2, 1), '-'), (const char*)fsdo.uuid + 2, 2, 1);
-  } else if (fsdo.uuid_size == 8) {  /* NTFS. */
-    p = emit_hex(p, (const char*)fsdo.uuid, 8, 1);
-  } else if (fsdo.uuid_size == 16) {  /* ext2 and Btrfs. */
-    p = emit_hex(emit_char(emit_hex(emit_char(emit_hex(emit_char(emit_hex(emit_char(emit_hex(p, (const char*)fsdo.uuid, 4, 0), '-'), (const char*)fsdo.uuid + 4, 2, 0), '-'), (const char*)fsdo.uuid + 6, 2, 0), '-'), (const char*)fsdo.uuid + 8, 2, 0), '-'), (const char*)fsdo.uuid + 10, 6, 0);
+  } else if (fsdo->uuid_size == 4) {  /* FAT. */
+    p = emit_hex(emit_char(emit_hex(p, (const char*)fsdo->uuid, 2, 1), '-'), (const char*)fsdo->uuid + 2, 2, 1);
+  } else if (fsdo->uuid_size == 8) {  /* NTFS. */
+    p = emit_hex(p, (const char*)fsdo->uuid, 8, 1);
+  } else if (fsdo->uuid_size == 16) {  /* ext2 and Btrfs. */
+    p = emit_hex(emit_char(emit_hex(emit_char(emit_hex(emit_char(emit_hex(emit_char(emit_hex(p, (const char*)fsdo->uuid, 4, 0), '-'), (const char*)fsdo->uuid + 4, 2, 0), '-'), (const char*)fsdo->uuid + 6, 2, 0), '-'), (const char*)fsdo->uuid + 8, 2, 0), '-'), (const char*)fsdo->uuid + 10, 6, 0);
   } else {
     p = emit_asciiz(p, "?s");
   }
-  p = emit_char(p, '\n');
+  return p;
+}
+
+/* Emits fsdo, with fields separated by sep. */
+REGPARM3 static char *emit_output(char *p, const struct fsdetect_output *fsdo, char sep) {
+  /* fsdo->fstype can be "?", fsdo->label can be empty, fsdo->uuid_size can be 0. */
+  p = emit_asciiz(emit_char(emit_asciiz(emit_asciiz(emit_char(emit_asciiz(emit_asciiz(p, "fstype="), fsdo->fstype), sep), "label="), fsdo->label), sep), "uuid=");
+  return emit_uuid(p, fsdo);
+}
+
+#ifdef HAVE_BATCH
+static void usage_error(void) {
+  /* One string per line, because C89 compilers support strings of at most
+   * 509 bytes.
+   */
+  static const char *const lines[] = {
+      "Usage: fsdetect [-S <bytes>] < <device-or-pipe>\n",
+      "       fsdetect [<flags>] <device> [...]\n",
+      "       fsdetect [<flags>] -0 < <nul-separated-device-list>\n",
+      "Flags:\n",
+      "  -S <bytes>: Read at most this much from a pipe. Default: 4 GiB.\n",
+      "  -j <threads>: Number of worker threads.\n",
+      "  -m: Map regular files to memory instead of reading them.\n",
+#ifdef HAVE_DIRECT
+      "  -d: Read with O_DIRECT in aligned sectors, bypassing the page cache.\n",
+#endif
+      "  -s: Print per-probe statistics to stderr.\n",
+      "  -p: Detect in each MBR or GPT partition of whole-disk devices.\n",
+      "  -V: Verify superblock checksums (ext4 metadata_csum, Btrfs).\n",
+      "  -B: Also report which devices of each Btrfs filesystem are found.\n",
+      "  -M: Use the newest Btrfs superblock, including the mirrors.\n",
+      "  -C <file>: Reuse unchanged results from (and save them to) file.\n",
+      "  -c: Find filesystems at any offset (carving), using -j threads.\n",
+      "  -F: Args are UUID=<uuid> or LABEL=<label>, find their devices\n",
+      "      among all block devices (or the -0 list).\n",
+#ifdef HAVE_DAEMON
+      "  -D <socket>: Run as a daemon, args are directories of images.\n",
+      "  -Q <socket>: Ask the daemon.\n",
+#endif
+#ifdef HAVE_URING
+      "  -u: Use io_uring instead of worker threads.\n",
+      "  -q <depth>: Number of reads in flight with -u. Default: 256.\n",
+#endif
+  };
+  uint32_t i;
+  for (i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i) {
+    (void)!write(2, lines[i], strlen(lines[i]));
+  }
+  exit(1);
+}
+
+REGPARM3 static char *emit_u64(char *p, uint64_t u) {
+  char tmp[20], *q = tmp + sizeof(tmp);
+  do {
+    *--q = '0' + (char)(u % 10);
+  } while ((u /= 10) != 0);
+  memcpy(p, q, tmp + sizeof(tmp) - q);
+  return p + (tmp + sizeof(tmp) - q);
+}
+
+/* Writes one line per probe to stderr, e.g.
+ * "probe=ext\truns=9\treads=9\tmiss_blocks=2\tbytes=4608\tns=1870\tresults=0:4,10:5,filtered:1".
+ * Result 0 is success, other numbers are the rejection codes of the probe.
+ */
+static void write_stats(const struct fsdetect_stats_total *total) {
+  static const char *const special_names[FSDETECT_RESULT_BIAS] = {
+      "not_run", "filtered", "-1" };
+  char buf[1024], *p;
+  const struct fsdetect_probe_stats_total *pt;
+  uint32_t probe_idx, i;
+  for (probe_idx = 0; probe_idx < FSDETECT_PROBE_COUNT; ++probe_idx) {
+    pt = &total->probes[probe_idx];
+    p = emit_asciiz(emit_asciiz(buf, "probe="), fsdetect_probe_name(probe_idx));
+    p = emit_u64(emit_asciiz(p, "\truns="), pt->run_count);
+    p = emit_u64(emit_asciiz(p, "\treads="), pt->read_count);
+    p = emit_u64(emit_asciiz(p, "\tmiss_blocks="), pt->miss_block_count);
+    p = emit_u64(emit_asciiz(p, "\tbytes="), pt->byte_count);
+    p = emit_u64(emit_asciiz(p, "\tns="), pt->elapsed_ns);
+    p = emit_asciiz(p, "\tresults=");
+    for (i = 0; i < FSDETECT_RESULT_BIAS + FSDETECT_RESULT_LIMIT; ++i) {
+      if (pt->result_counts[i] == 0) continue;
+      if (p[-1] != '=') p = emit_char(p, ',');
+      p = i < FSDETECT_RESULT_BIAS ? emit_asciiz(p, special_names[i]) :
+          emit_u64(p, i - FSDETECT_RESULT_BIAS);
+      p = emit_u64(emit_char(p, ':'), pt->result_counts[i]);
+    }
+    p = emit_char(p, '\n');
+    (void)!write(2, buf, p - buf);
+  }
+}
+
+static int compare_btrfs_items(const void *a, const void *b) {
+  const struct batch_item *ia = *(const struct batch_item *const*)a;
+  const struct batch_item *ib = *(const struct batch_item *const*)b;
+  const int c = memcmp(ia->fsdo.uuid, ib->fsdo.uuid, 16);
+  if (c != 0) return c;
+  return ia->btrfs_info->devid < ib->btrfs_info->devid ? -1 :
+         ia->btrfs_info->devid > ib->btrfs_info->devid;
+}
+
+/* Writes one line per Btrfs filesystem (fsid) found in items (not in
+ * partitions), with the devids present and missing, followed by one line
+ * per device, e.g.
+ *
+ *   btrfs=<fsid>\tlabel=data\tnum_devices=3\tpresent=1,3\tmissing=2
+ *   btrfs=<fsid>\tdevid=1\tgeneration=9\tsuperblock=0\tpath=/dev/sdb
+ *
+ * num_devices and the label are from the device with the highest
+ * generation. Missing devids are those in 1 .. num_devices not present.
+ */
+static void write_btrfs_report(struct batch_item *items, uint32_t item_count) {
+  static char outbuf[65536];
+  char *p = outbuf;
+  struct batch_item **found, **group, **group_end, **it;
+  const struct batch_item *newest;
+  uint32_t found_count = 0, i;
+  uint64_t devid, prev_devid;
+  if (!(found = (struct batch_item**)malloc(
+      (item_count + !item_count) * sizeof(*found)))) exit(2);
+  for (i = 0; i < item_count; ++i) {
+    if (!items[i].parts && items[i].btrfs_info &&
+        0 == strcmp(items[i].fsdo.fstype, "btrfs")) found[found_count++] = items + i;
+  }
+  qsort(found, found_count, sizeof(*found), compare_btrfs_items);
+  for (group = found; group != found + found_count; group = group_end) {
+    newest = *group;
+    for (group_end = group; group_end != found + found_count &&
+         0 == memcmp((*group_end)->fsdo.uuid, (*group)->fsdo.uuid, 16);
+         ++group_end) {
+      if ((*group_end)->btrfs_info->generation > newest->btrfs_info->generation) {
+        newest = *group_end;
+      }
+    }
+    if ((size_t)(outbuf + sizeof(outbuf) - p) < 192) {
+      (void)!write(1, outbuf, p - outbuf);
+      p = outbuf;
+    }
+    p = emit_uuid(emit_asciiz(p, "btrfs="), &newest->fsdo);
+    p = emit_asciiz(emit_asciiz(p, "\tlabel="), newest->fsdo.label);
+    p = emit_u64(emit_asciiz(p, "\tnum_devices="), newest->btrfs_info->num_devices);
+    p = emit_asciiz(p, "\tpresent=");
+    for (prev_devid = 0, it = group; it != group_end; ++it) {
+      if ((devid = (*it)->btrfs_info->devid) == prev_devid) continue;  /* Same device twice. */
+      if (p[-1] != '=') p = emit_char(p, ',');
+      p = emit_u64(p, prev_devid = devid);
+      if ((size_t)(outbuf + sizeof(outbuf) - p) < 32) {
+        (void)!write(1, outbuf, p - outbuf);
+        p = outbuf;
+      }
+    }
+    p = emit_asciiz(p, "\tmissing=");
+    for (devid = 1, it = group; devid <= newest->btrfs_info->num_devices; ++devid) {
+      for (; it != group_end && (*it)->btrfs_info->devid < devid; ++it) {}
+      if (it != group_end && (*it)->btrfs_info->devid == devid) continue;
+      if (p[-1] != '=') p = emit_char(p, ',');
+      p = emit_u64(p, devid);
+      if ((size_t)(outbuf + sizeof(outbuf) - p) < 32) {
+        (void)!write(1, outbuf, p - outbuf);
+        p = outbuf;
+      }
+    }
+    p = emit_char(p, '\n');
+    for (it = group; it != group_end; ++it) {
+      if ((size_t)(outbuf + sizeof(outbuf) - p) < strlen((*it)->path) + 192) {
+        (void)!write(1, outbuf, p - outbuf);
+        p = outbuf;
+        if (strlen((*it)->path) + 192 > sizeof(outbuf)) continue;  /* Too long. */
+      }
+      p = emit_uuid(emit_asciiz(p, "btrfs="), &(*it)->fsdo);
+      p = emit_u64(emit_asciiz(p, "\tdevid="), (*it)->btrfs_info->devid);
+      p = emit_u64(emit_asciiz(p, "\tgeneration="), (*it)->btrfs_info->generation);
+      p = emit_u64(emit_asciiz(p, "\tsuperblock="), (*it)->btrfs_info->sb_idx);
+      p = emit_char(emit_asciiz(emit_asciiz(p, "\tpath="), (*it)->path), '\n');
+    }
+  }
+  (void)!write(1, outbuf, p - outbuf);
+  free(found);
+}
+
+/* Emits the output line for a path too long for the output buffer: the
+ * first max_size - 3 bytes of the path followed by "...", and fstype=?.
+ */
+static char *emit_long_path(char *p, const char *path, size_t max_size) {
+  memcpy(p = emit_asciiz(p, "path="), path, max_size - 3);
+  p = emit_asciiz(p + max_size - 3, "...\t");
+  return emit_asciiz(p, "fstype=?\tlabel=\tuuid=?\n");
+}
+
+/* Detects the filesystem on each path, writes one output line per path,
+ * in input order.
+ */
+static void run_batch(char **paths, uint32_t path_count,
+                      uint32_t thread_count, uint32_t queue_depth,
+                      uint32_t flags, char is_stats, char is_btrfs_report,
+                      const char *cache_filename) {
+  static char outbuf[65536];
+  char *p = outbuf;
+  struct batch_item *items;
+  struct batch *batch;
+  struct fsdetect_stats *stats = 0;
+  struct fsdetect_btrfs_info *btrfs_infos = 0;
+  struct rcache *rc = 0;
+  struct fsdetect_stats_total total;
+  const struct fsdetect_output *fsdo;
+  const struct fsdetect_partition *part;
+  uint32_t i, j, probe_idx;
+  if (!(items = (struct batch_item*)malloc(
+      (path_count + !path_count) * sizeof(*items)))) exit(2);
+  if (cache_filename &&
+      !(rc = rcache_load(cache_filename, paths, path_count))) exit(2);
+  if (is_stats && !(stats = (struct fsdetect_stats*)malloc(
+      (path_count + !path_count) * sizeof(*stats)))) exit(2);
+  if (is_btrfs_report && !(btrfs_infos = (struct fsdetect_btrfs_info*)malloc(
+      (path_count + !path_count) * sizeof(*btrfs_infos)))) exit(2);
+  for (i = 0; i < path_count; ++i) {
+    items[i].path = paths[i];
+    items[i].stats = 0;
+    items[i].parts = 0;
+    items[i].cache_entry = 0;
+    items[i].is_done = 0;
+    items[i].btrfs_info = btrfs_infos ? btrfs_infos + i : 0;
+    /* Cached results don't have the Btrfs info. */
+    if (rc && !(flags & BATCH_PARTITIONS) && !btrfs_infos) {
+      items[i].cache_entry = rcache_find(rc, paths[i]);
+      /* A path given twice: only one item may update the entry. */
+      if (items[i].cache_entry->is_used) {
+        items[i].cache_entry = 0;
+      } else {
+        items[i].cache_entry->is_used = 1;
+      }
+    }
+    if (stats) {  /* Remains like this if the open fails. */
+      items[i].stats = stats + i;
+      for (probe_idx = 0; probe_idx < FSDETECT_PROBE_COUNT; ++probe_idx) {
+        stats[i].probes[probe_idx].result = FSDETECT_RESULT_NOT_RUN;
+        stats[i].probes[probe_idx].read_count = 0;
+        stats[i].probes[probe_idx].miss_block_count = 0;
+        stats[i].probes[probe_idx].byte_count = 0;
+        stats[i].probes[probe_idx].elapsed_ns = 0;
+      }
+    }
+  }
+#ifdef HAVE_URING
+  if (queue_depth != 0 &&
+      uring_run(items, path_count, queue_depth, flags) == 0) {
+    /* batch_wait_item detects only the items left (e.g. qcow2 images). */
+    thread_count = 0;
+  }
+#else
+  (void)queue_depth;
+#endif
+  if (!(batch = batch_start(items, path_count, thread_count, flags))) exit(2);
+  for (i = 0; i < path_count; ++i) {
+    batch_wait_item(batch, i);
+    /* One line for the device, or one line per partition. */
+    for (j = 0; j < (items[i].parts ? items[i].part_count : 1); ++j) {
+      /* Output line: path, partition (at most 80 bytes), fstype, label,
+       * uuid (at most 85 bytes).
+       */
+      if ((size_t)(outbuf + sizeof(outbuf) - p) < strlen(items[i].path) + 192) {
+        (void)!write(1, outbuf, p - outbuf);
+        p = outbuf;
+        if (strlen(items[i].path) + 192 > sizeof(outbuf)) {  /* Too long. */
+          p = emit_long_path(p, items[i].path, sizeof(outbuf) - 192);
+          break;
+        }
+      }
+      p = emit_char(emit_asciiz(emit_asciiz(p, "path="), items[i].path), '\t');
+      fsdo = &items[i].fsdo;
+      if (items[i].parts) {
+        part = items[i].parts + j;
+        p = emit_u64(emit_asciiz(p, "partition="), part->number);
+        p = emit_u64(emit_asciiz(p, "\tstart="), part->start_block);
+        p = emit_char(emit_u64(emit_asciiz(p, "\tsize="), part->block_count), '\t');
+        fsdo = &part->fsdo;
+      }
+      p = emit_char(emit_output(p, fsdo, '\t'), '\n');
+    }
+  }
+  (void)!write(1, outbuf, p - outbuf);
+  batch_finish(batch);
+  if (btrfs_infos) {
+    write_btrfs_report(items, path_count);
+    free(btrfs_infos);
+  }
+  for (i = 0; i < path_count; ++i) {
+    free(items[i].parts);
+  }
+  if (rc) {
+    if (rcache_save(rc) != 0) {
+      static const char msg[] = "fsdetect: error saving the result cache\n";
+      (void)!write(2, msg, sizeof(msg) - 1);
+    }
+    rcache_free(rc);
+  }
+  if (stats) {
+    memset(&total, '\0', sizeof(total));
+    for (i = 0; i < path_count; ++i) {
+      fsdetect_stats_add(&total, stats + i);
+    }
+    write_stats(&total);
+    free(stats);
+  }
+  free(items);
+}
+
+#ifdef HAVE_DAEMON
+static char *emit_result(char *p, const char *path,
+                         const struct fsdetect_output *fsdo) {
+  p = emit_char(emit_asciiz(emit_asciiz(p, "path="), path), '\t');
+  return emit_char(emit_output(p, fsdo, '\t'), '\n');
+}
+#endif
+
+/* Scans each path for filesystems at any offset, writes one output line
+ * per filesystem found.
+ */
+static void run_scan(char **paths, uint32_t path_count,
+                     uint32_t thread_count) {
+  char outbuf[4096], *p;
+  struct scan_result *results;
+  uint32_t i, j, result_count;
+  for (i = 0; i < path_count; ++i) {
+    if (strlen(paths[i]) + 192 > sizeof(outbuf)) {  /* Too long. */
+      p = emit_long_path(outbuf, paths[i], sizeof(outbuf) - 192);
+      (void)!write(1, outbuf, p - outbuf);
+      continue;
+    }
+    if (!(results = scan_run(paths[i], thread_count, &result_count))) {
+      p = emit_char(emit_asciiz(emit_asciiz(outbuf, "path="), paths[i]), '\t');
+      p = emit_asciiz(p, "error=scan\n");
+      (void)!write(1, outbuf, p - outbuf);
+      continue;
+    }
+    for (j = 0; j < result_count; ++j) {
+      p = emit_char(emit_asciiz(emit_asciiz(outbuf, "path="), paths[i]), '\t');
+      p = emit_char(emit_u64(emit_asciiz(p, "start="), results[j].start_block), '\t');
+      p = emit_char(emit_output(p, &results[j].fsdo, '\t'), '\n');
+      (void)!write(1, outbuf, p - outbuf);
+    }
+    free(results);
+  }
+}
+
+/* An entry of the UUID and label index of run_findfs. */
+struct index_entry {
+  struct index_entry *next;  /* In the same hash bucket. */
+  const char *path;
+  char key[1];  /* Actually longer, e.g. "LABEL=boot". */
+};
+
+/* FNV-1a. */
+static uint32_t hash_key(const char *key) {
+  uint32_t hash = 0x811c9dc5;
+  for (; *key != '\0'; ++key) {
+    hash = (hash ^ (unsigned char)*key) * 0x1000193;
+  }
+  return hash;
+}
+
+/* Emits key in the index format: UUIDs are lowercase. */
+static char *emit_key(char *p, const char *key) {
+  const char is_uuid = 0 == strncmp(key, "UUID=", 5);
+  for (; *key != '\0'; ++key) {
+    *p++ = is_uuid && *key >= 'A' && *key <= 'Z' ? *key + ('a' - 'A') : *key;
+  }
+  *p = '\0';
+  return p;
+}
+
+/* Finds the device with each of keys (UUID=<uuid> or LABEL=<label>),
+ * detecting the devices in paths on thread_count threads, and stopping
+ * once all keys are found. Writes "<key>\t<path>" for each key found.
+ * Returns the exit code.
+ */
+static int run_findfs(char **keys, uint32_t key_count, char **paths,
+                      uint32_t path_count, uint32_t thread_count) {
+  char buf[4096], *p;
+  struct batch_item *items;
+  struct batch *batch;
+  struct index_entry **buckets, *e, *next;
+  const char **found;
+  uint32_t i, j, k, bucket_count = 16, found_count = 0;
+  int exit_code = 0;
+  while (bucket_count < path_count * 2) bucket_count <<= 1;
+  if (!(items = (struct batch_item*)calloc(path_count + 1, sizeof(*items))) ||
+      !(buckets = (struct index_entry**)calloc(
+          bucket_count, sizeof(*buckets))) ||
+      !(found = (const char**)calloc(key_count + 1, sizeof(*found)))) exit(2);
+  for (i = 0; i < path_count; ++i) {
+    items[i].path = paths[i];
+  }
+  if (!(batch = batch_start(items, path_count, thread_count, 0))) exit(2);
+  for (i = 0; i < path_count && found_count < key_count; ++i) {
+    batch_wait_item(batch, i);
+    if (items[i].fsdo.fstype[0] == '?') continue;
+    /* Index the UUID and the label of the device. */
+    for (j = 0; j < 2; ++j) {
+      if (j == 0 ? items[i].fsdo.uuid_size == 0 :
+          items[i].fsdo.label[0] == '\0') continue;
+      p = j == 0 ? emit_uuid(emit_asciiz(buf, "UUID="), &items[i].fsdo) :
+          emit_asciiz(emit_asciiz(buf, "LABEL="), items[i].fsdo.label);
+      *p = '\0';
+      emit_key(buf, buf);
+      for (e = buckets[hash_key(buf) & (bucket_count - 1)];
+           e && 0 != strcmp(e->key, buf); e = e->next) {}
+      if (e) continue;  /* The first device with the key wins. */
+      if (!(e = (struct index_entry*)malloc(sizeof(*e) + (p - buf)))) exit(2);
+      memcpy(e->key, buf, p - buf + 1);
+      e->path = items[i].path;
+      e->next = buckets[hash_key(buf) & (bucket_count - 1)];
+      buckets[hash_key(buf) & (bucket_count - 1)] = e;
+    }
+    /* Resolve the pending keys. */
+    for (k = 0; k < key_count; ++k) {
+      if (found[k] || strlen(keys[k]) >= sizeof(buf)) continue;
+      emit_key(buf, keys[k]);
+      for (e = buckets[hash_key(buf) & (bucket_count - 1)];
+           e && 0 != strcmp(e->key, buf); e = e->next) {}
+      if (e) {
+        found[k] = e->path;
+        ++found_count;
+      }
+    }
+  }
+  batch_cancel(batch);  /* All found: don't detect the rest. */
+  batch_finish(batch);
+  for (k = 0; k < key_count; ++k) {
+    if (!found[k] || strlen(keys[k]) + strlen(found[k]) + 2 > sizeof(buf)) {
+      p = emit_char(emit_asciiz(emit_asciiz(buf, "fsdetect: not found: "),
+                                keys[k]), '\n');
+      (void)!write(2, buf, p - buf);
+      exit_code = 1;
+    } else {
+      p = emit_char(emit_asciiz(emit_char(emit_asciiz(buf, keys[k]), '\t'),
+                                found[k]), '\n');
+      (void)!write(1, buf, p - buf);
+    }
+  }
+  for (i = 0; i < bucket_count; ++i) {
+    for (e = buckets[i]; e; e = next) {
+      next = e->next;
+      free(e);
+    }
+  }
+  free(found);
+  free(buckets);
+  free(items);
+  return exit_code;
+}
+#endif
+
+/* Detects the filesystem on stdin, and writes the result to stdout. The
+ * scratch memory is on the stack, so it takes memory only in this mode
+ * (not .bss in every build).
+ */
+static void detect_stdin(uint64_t stream_limit_block_count) {
+  struct fsdetect_args args;
+  struct fsdetect_output fsdo;
+  char outbuf[256], *p = outbuf;
+  uint64_t scratch[FSDETECT_SCRATCH_SIZE / 8];
+  memset(&args, '\0', sizeof(args));
+  args.read_block64 = fsdetect_fd_read_block;
+  args.read_block_data = (void*)0;  /* stdin */
+#ifdef HAVE_PREADV
+  args.read_block_list = fsdetect_fd_read_block_list;
+#endif
+  args.scratch = scratch;
+  args.scratch_size = sizeof(scratch);
+  if (lseek(0, 0, SEEK_SET) < 0) {  /* A pipe, fsdetect_ex would fail. */
+    stream_detect(0, stream_limit_block_count, &args, &fsdo);
+  } else {
+    fsdetect_ex(&args, &fsdo);
+  }
+  p = emit_char(emit_output(p, &fsdo, '\n'), '\n');
   (void)!write(1, outbuf, p - outbuf);
+}
+
+int main(int argc, char **argv) {
+  uint64_t stream_limit_block_count = STREAM_LIMIT_BLOCK_COUNT;
+
+#ifdef HAVE_BATCH
+  if (argc == 3 && 0 == strcmp(argv[1], "-S")) {
+    stream_limit_block_count = strtoul(argv[2], 0, 10) >> 9;
+    argc = 1;
+  }
+  if (argc > 1) {
+    uint32_t thread_count = sysconf(_SC_NPROCESSORS_ONLN) * 4;
+    uint32_t queue_depth = 256, flags = 0;
+    char is_stdin_list = 0, is_uring = 0, is_stats = 0, is_carve = 0;
+    char is_findfs = 0, is_btrfs_report = 0;
+    char **argi = argv + 1, **paths = 0, **keys = 0;
+    const char *cache_filename = 0, *daemon_socket = 0, *query_socket = 0;
+    uint32_t path_count = 0, key_count = 0, capacity = 0;
+    for (; *argi && argi[0][0] == '-'; ++argi) {
+      if (0 == strcmp(*argi, "--")) {
+        ++argi;
+        break;
+      } else if (0 == strcmp(*argi, "-0")) {
+        is_stdin_list = 1;
+      } else if (0 == strcmp(*argi, "-m")) {
+        flags |= BATCH_MMAP;
+#ifdef HAVE_DIRECT
+      } else if (0 == strcmp(*argi, "-d")) {
+        flags |= BATCH_DIRECT;
+#endif
+      } else if (0 == strcmp(*argi, "-V")) {
+        flags |= BATCH_VERIFY_CSUM;
+      } else if (0 == strcmp(*argi, "-B")) {
+        is_btrfs_report = 1;
+      } else if (0 == strcmp(*argi, "-M")) {
+        flags |= BATCH_BTRFS_MIRRORS;
+      } else if (0 == strcmp(*argi, "-p")) {
+        flags |= BATCH_PARTITIONS;
+      } else if (0 == strcmp(*argi, "-C") && argi[1]) {
+        cache_filename = *++argi;
+#ifdef HAVE_DAEMON
+      } else if (0 == strcmp(*argi, "-D") && argi[1]) {
+        daemon_socket = *++argi;
+      } else if (0 == strcmp(*argi, "-Q") && argi[1]) {
+        query_socket = *++argi;
+#endif
+      } else if (0 == strcmp(*argi, "-c")) {
+        is_carve = 1;
+      } else if (0 == strcmp(*argi, "-F")) {
+        is_findfs = 1;
+      } else if (0 == strcmp(*argi, "-s")) {
+        is_stats = 1;
+      } else if (0 == strcmp(*argi, "-j") && argi[1]) {
+        thread_count = strtoul(*++argi, 0, 10);
+#ifdef HAVE_URING
+      } else if (0 == strcmp(*argi, "-u")) {
+        is_uring = 1;
+      } else if (0 == strcmp(*argi, "-q") && argi[1]) {
+        queue_depth = strtoul(*++argi, 0, 10);
+#endif
+      } else {
+        usage_error();
+      }
+    }
+    /* The io_uring engine doesn't descend into partitions, doesn't use
+     * the result cache, and doesn't read aligned.
+     */
+    if (!is_uring || (flags & (BATCH_PARTITIONS | BATCH_DIRECT)) ||
+        cache_filename) {
+      queue_depth = 0;
+    }
+#ifdef HAVE_DAEMON
+    if (daemon_socket) {  /* One output line per path. */
+      if (flags & BATCH_PARTITIONS) usage_error();
+      return daemon_run(daemon_socket, argi, argc - (argi - argv),
+                        thread_count, flags, emit_result);
+    }
+#endif
+    if (is_findfs) {  /* The args are the keys, not the paths. */
+      keys = argi;
+      key_count = argc - (argi - argv);
+      if (key_count == 0) usage_error();
+      argi += key_count;
+      if (!is_stdin_list) {
+        list_dir("/dev", 0, &paths, &path_count, &capacity);
+        return run_findfs(keys, key_count, paths, path_count, thread_count);
+      }
+    }
+    if (is_stdin_list) {
+      size_t size;
+      char *list, *q, *list_end;
+      if (*argi) usage_error();
+      if (!(list = read_all(0, &size))) return 2;
+      for (q = list, list_end = list + size; q != list_end; ++q) {
+        if (*q == '\0') ++path_count;
+      }
+      ++path_count;  /* The last path may not be NUL-terminated. */
+      if (!(paths = (char**)malloc(path_count * sizeof(*paths)))) return 2;
+      for (path_count = 0, q = list; q < list_end; q += strlen(q) + 1) {
+        if (*q != '\0') paths[path_count++] = q;
+      }
+    } else {
+      if (!*argi) usage_error();
+      paths = argi;
+      path_count = argc - (argi - argv);
+    }
+#ifdef HAVE_DAEMON
+    if (query_socket) return daemon_query(query_socket, paths, path_count);
+#endif
+    if (is_findfs) {
+      return run_findfs(keys, key_count, paths, path_count, thread_count);
+    } else if (is_carve) {
+      run_scan(paths, path_count, thread_count);
+    } else {
+      run_batch(paths, path_count, thread_count, queue_depth, flags,
+                is_stats, is_btrfs_report, cache_filename);
+    }
+    /* The paths and the list are freed by exit. */
+    return 0;
+  }
+#else
+  (void)argc; (void)argv;
+#endif
+  detect_stdin(stream_limit_block_count);
   return 0;
 }
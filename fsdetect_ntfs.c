@@ -73,32 +73,63 @@ struct Assert512BytesStruct {
 
 #define MFT_RECORD_VOLUME  3
 #define NTFS_MAX_CLUSTER_SIZE  (64 * 1024)
+#define NTFS_MAX_MFT_RECORD_SIZE  (64 * 1024)
+/* The update sequence array protects the last 2 bytes of each 512 bytes. */
+#define NTFS_USA_STRIDE  512
+
+struct AssertScratchStruct {
+   int AssertScratch : FSDETECT_SCRATCH_SIZE >=
+       (MFT_RECORD_VOLUME + 1) * NTFS_MAX_MFT_RECORD_SIZE; };
+
+/* Applies the update sequence array fixups to an MFT record in place.
+ * Returns nonzero if the record is torn or the array is invalid.
+ */
+static int apply_fixups(unsigned char *rec, uint32_t rec_size) {
+  const struct master_file_table_record *mft =
+      (const struct master_file_table_record*)rec;
+  const uint32_t usa_ofs = le(mft->usa_ofs), usa_count = le(mft->usa_count);
+  unsigned char *usa, *p;
+  uint32_t i;
+  if (usa_count != rec_size / NTFS_USA_STRIDE + 1 ||
+      usa_ofs + 2 * usa_count > rec_size || (usa_ofs & 1)) return -1;
+  usa = rec + usa_ofs;  /* usa[0 .. 1] is the update sequence number. */
+  for (i = 1; i < usa_count; ++i) {
+    p = rec + i * NTFS_USA_STRIDE - 2;
+    if (p[0] != usa[0] || p[1] != usa[1]) return -1;
+    p[0] = usa[2 * i];
+    p[1] = usa[2 * i + 1];
+  }
+  return 0;
+}
 
 #define MFT_RECORD_ATTR_VOLUME_NAME 0x60U
 #define MFT_RECORD_ATTR_END 0xffffffffU
 
 /* Code based on util-linux-2.31/libblkid/src/superblocks/ntfs.c */
-int fsdetect_ntfs(read_block_t read_block, void *read_block_data,
+int fsdetect_ntfs(const struct fsdetect_reader *rd,
                   struct fsdetect_output *fsdo) {
-  struct ntfs_super_block sb;
-  unsigned char buf[4096];
-  struct master_file_table_record *mft;
-  uint32_t sectors_per_cluster, mft_record_size;
+  struct ntfs_super_block sb_buf;
+  const struct ntfs_super_block *sb;
+  unsigned char buf[4096], *work = buf, *rec;
+  const unsigned char *recs;  /* MFT records. */
+  const struct master_file_table_record *mft;
+  uint32_t sectors_per_cluster, mft_record_size, work_size = sizeof(buf);
   uint16_t sector_size;
-  uint32_t block_off, attr_off;
-  uint64_t nr_clusters;
-
-  if (read_block(read_block_data, 0, 1, &sb) != 0) return -1;
-  if (0 != memcmp(sb.oem_id, "NTFS    ", 8) &&
-      0 != memcmp(sb.oem_id, "MSWIN4.0", 8) &&
-      0 != memcmp(sb.oem_id, "MSWIN4.1", 8)
+  uint32_t attr_off;
+  uint64_t nr_clusters, block_off;
+
+  if (!(sb = (const struct ntfs_super_block*)get_blocks(
+      rd, NTFS_SB_BLOCK, 1, &sb_buf))) return -1;
+  if (0 != memcmp(sb->oem_id, "NTFS    ", 8) &&
+      0 != memcmp(sb->oem_id, "MSWIN4.0", 8) &&
+      0 != memcmp(sb->oem_id, "MSWIN4.1", 8)
      ) return 10;
 
   /*
    * Check bios parameters block
    */
-  sector_size = unaligned_le16(sb.bpb.sector_size);
-  sectors_per_cluster = sb.bpb.sectors_per_cluster;
+  sector_size = unaligned_le16(sb->bpb.sector_size);
+  sectors_per_cluster = sb->bpb.sectors_per_cluster;
 
   /* This is more strict than util-linux. */
   switch (sector_size) {
@@ -115,29 +146,29 @@ int fsdetect_ntfs(read_block_t read_block, void *read_block_data,
     return 12;
   }
 
-  if ((uint16_t) le(sb.bpb.sector_size) *
-      sb.bpb.sectors_per_cluster > NTFS_MAX_CLUSTER_SIZE)
+  if ((uint16_t) le(sb->bpb.sector_size) *
+      sb->bpb.sectors_per_cluster > NTFS_MAX_CLUSTER_SIZE)
     return 13;
 
   /* Unused fields must be zero */
-  if (le(sb.bpb.reserved_sectors)  /* FAT12, FAT16 and FAT32 have >=1 here. */
-      || unaligned_le16(sb.bpb.root_entries)
-      || unaligned_le16(sb.bpb.sectors)
-      || le(sb.bpb.sectors_per_fat)
-      || le(sb.bpb.large_sectors)
-      || sb.bpb.fats)  /* FAT12, FAT16 and FAT32 have 1 or 2 here. */
+  if (le(sb->bpb.reserved_sectors)  /* FAT12, FAT16 and FAT32 have >=1 here. */
+      || unaligned_le16(sb->bpb.root_entries)
+      || unaligned_le16(sb->bpb.sectors)
+      || le(sb->bpb.sectors_per_fat)
+      || le(sb->bpb.large_sectors)
+      || sb->bpb.fats)  /* FAT12, FAT16 and FAT32 have 1 or 2 here. */
     return 14;
 
-  if (!(0xf8 <= sb.bpb.media_type || sb.bpb.media_type == 0xf0))
+  if (!(0xf8 <= sb->bpb.media_type || sb->bpb.media_type == 0xf0))
     return 22;
 
-  if (le16(sb.boot_signature) != 0xaa55)
+  if (le16(sb->boot_signature) != 0xaa55)
     return 23;
 
-  if ((uint8_t) sb.clusters_per_mft_record < 0xe1
-      || (uint8_t) sb.clusters_per_mft_record > 0xf7) {
+  if ((uint8_t) sb->clusters_per_mft_record < 0xe1
+      || (uint8_t) sb->clusters_per_mft_record > 0xf7) {
 
-    switch (sb.clusters_per_mft_record) {
+    switch (sb->clusters_per_mft_record) {
     case 1: case 2: case 4: case 8: case 16: case 32: case 64:
       break;
     default:
@@ -145,29 +176,31 @@ int fsdetect_ntfs(read_block_t read_block, void *read_block_data,
     }
   }
 
-  if (sb.clusters_per_mft_record > 0)
-    mft_record_size = sb.clusters_per_mft_record *
+  if (sb->clusters_per_mft_record > 0)
+    mft_record_size = sb->clusters_per_mft_record *
           sectors_per_cluster * sector_size;
   else
-    mft_record_size = 1 << (0 - sb.clusters_per_mft_record);
-  switch (mft_record_size) {
-   /* Maximum is 4096 so that it fits to buf, and also the NTFS kernel
-    * driver needs it to be at most the page size.
-    */
-   case 512: case 1024: case 2048: case 4096:
-    break;
-   default:
-    return 21;
+    mft_record_size = 1 << (0 - sb->clusters_per_mft_record);
+  if (rd->scratch_size > work_size) {
+    work = rd->scratch;
+    work_size = rd->scratch_size;
   }
+  /* Must fit to work. The NTFS kernel driver supports at most the page
+   * size (typically 4096), ntfs-3g supports larger.
+   */
+  if (mft_record_size < 512 || mft_record_size > NTFS_MAX_MFT_RECORD_SIZE ||
+      (mft_record_size & (mft_record_size - 1)) != 0 ||
+      mft_record_size > work_size)
+    return 21;
 
-  nr_clusters = le64(sb.number_of_sectors) / sectors_per_cluster;
+  nr_clusters = le64(sb->number_of_sectors) / sectors_per_cluster;
 
-  if ((le64(sb.mft_cluster_location) >= nr_clusters) ||
-      (le64(sb.mft_mirror_cluster_location) >= nr_clusters))
+  if ((le64(sb->mft_cluster_location) >= nr_clusters) ||
+      (le64(sb->mft_mirror_cluster_location) >= nr_clusters))
     return 16;
 
 
-  block_off = le64(sb.mft_cluster_location) * (sector_size >> 9) *
+  block_off = le64(sb->mft_cluster_location) * (sector_size >> 9) *
       sectors_per_cluster;
 
   /* Typical: mft_record_size=1024 */
@@ -181,22 +214,40 @@ int fsdetect_ntfs(read_block_t read_block, void *read_block_data,
       (long long)block_off);
 #endif
 
-  if (read_block(read_block_data, block_off, mft_record_size >> 9, buf) != 0) return 17;
-  if (memcmp(buf, "FILE", 4)) return 18;
-  block_off += MFT_RECORD_VOLUME * (mft_record_size >> 9);
-  if (read_block(read_block_data, block_off, mft_record_size >> 9, buf) != 0) return 19;
-  if (memcmp(buf, "FILE", 4)) return 20;
+  if ((MFT_RECORD_VOLUME + 1) * mft_record_size <= work_size) {
+    /* Records 0 ($MFT) to 3 ($Volume) with a single read. */
+    if (!(recs = (const unsigned char*)get_blocks(
+        rd, block_off, (MFT_RECORD_VOLUME + 1) * (mft_record_size >> 9),
+        work))) return 17;
+    if (memcmp(recs, "FILE", 4)) return 18;
+    recs += MFT_RECORD_VOLUME * mft_record_size;
+  } else {
+    if (!(recs = (const unsigned char*)get_blocks(
+        rd, block_off, mft_record_size >> 9, work))) return 17;
+    if (memcmp(recs, "FILE", 4)) return 18;
+    block_off += MFT_RECORD_VOLUME * (mft_record_size >> 9);
+    if (!(recs = (const unsigned char*)get_blocks(
+        rd, block_off, mft_record_size >> 9, work))) return 19;
+  }
+  if (memcmp(recs, "FILE", 4)) return 20;
+  /* map_block returns read-only memory. */
+  if (recs < work || recs >= work + work_size) {
+    memcpy(work, recs, mft_record_size);
+    recs = work;
+  }
+  rec = (unsigned char*)recs;  /* Points to work. */
+  if (apply_fixups(rec, mft_record_size)) return 24;
 
   strcpy(fsdo->fstype, "ntfs");
-  mft = (struct master_file_table_record *) buf;
+  mft = (const struct master_file_table_record *) rec;
   attr_off = le(mft->attrs_offset);
   while (attr_off + sizeof(struct file_attribute) <= mft_record_size &&
          attr_off <= le(mft->bytes_allocated)) {
 
     uint32_t attr_len;
-    struct file_attribute *attr;
+    const struct file_attribute *attr;
 
-    attr = (struct file_attribute *) (buf + attr_off);
+    attr = (const struct file_attribute *) (rec + attr_off);
     attr_len = le(attr->len);
     if (!attr_len)
       break;
@@ -206,7 +257,7 @@ int fsdetect_ntfs(read_block_t read_block, void *read_block_data,
     if (le(attr->type) == MFT_RECORD_ATTR_VOLUME_NAME) {
       unsigned int val_off = le(attr->value_offset);
       unsigned int val_len = le(attr->value_len);
-      unsigned char *val = ((uint8_t *) attr) + val_off;
+      const unsigned char *val = ((const uint8_t *) attr) + val_off;
 
       if (attr_off + val_off + val_len <= mft_record_size) {
         /* TODO(pts): Smarter. */
@@ -230,7 +281,7 @@ int fsdetect_ntfs(read_block_t read_block, void *read_block_data,
 
   fsdo->uuid_size = 8;
   {
-    const uint8_t *q = sb.volume_serial;
+    const uint8_t *q = sb->volume_serial;
     uint8_t *pend = fsdo->uuid, *p = pend + 8;
     /* Emit it in the same order as /sbin/blkid and Busybox blkid does. */
     for (; p != pend; *--p = *q++) {}
@@ -0,0 +1,377 @@
+#include "fsdetect_impl.h"
+
+/* https://en.wikipedia.org/wiki/Master_boot_record
+ * https://en.wikipedia.org/wiki/Extended_boot_record
+ * https://en.wikipedia.org/wiki/GUID_Partition_Table
+ *
+ * Only 512-byte sectors are supported, like in the rest of fsdetect.
+ */
+
+#define MBR_ENTRY_OFS 0x1be
+#define MBR_TYPE_EMPTY 0
+#define MBR_TYPE_GPT 0xee  /* Protective MBR. */
+#define MAX_EBR_COUNT 128  /* Stops loops in the chain of logical partitions. */
+#define MAX_GPT_ENTRY_COUNT 1024
+#define GPT_READ_BLOCK_COUNT 8  /* Partition entry array is read in 4 KiB. */
+/* Number of partitions whose read plans are prefetched together. */
+#define PREFETCH_PART_COUNT 8
+#define PLAN_BLOCK_COUNT FSDETECT_PLAN_BLOCK_COUNT
+
+static __inline__ char is_mbr_extended(uint8_t type) {
+  return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+static __inline__ uint32_t get32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static __inline__ uint64_t get64(const unsigned char *p) {
+  return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+/* Reads from the whole device, using whichever callback args has. */
+static const unsigned char *read_abs(const struct fsdetect_args *args,
+                                     uint64_t block_idx, uint32_t block_count,
+                                     void *buf) {
+  if (args->map_block) {
+    return (const unsigned char*)args->map_block(
+        args->read_block_data, block_idx, block_count);
+  }
+  if (args->read_block64) {
+    if (args->read_block64(args->read_block_data, block_idx, block_count,
+                           buf) != 0) return 0;
+  } else {
+    if (block_idx + block_count > (uint64_t)1 << 32 ||
+        args->read_block(args->read_block_data, (uint32_t)block_idx,
+                         block_count, buf) != 0) return 0;
+  }
+  return (const unsigned char*)buf;
+}
+
+/* Offset-translating adapter: presents a partition as a device to
+ * fsdetect_ex. Reads beyond the end of the partition fail.
+ */
+struct part_adapter {
+  const struct fsdetect_args *args;
+  uint64_t start_block;
+  uint64_t block_count;
+  /* Blocks (absolute) prefetched for all partitions in the batch. */
+  const uint64_t *prefetch_idxs;
+  const unsigned char (*prefetch_blocks)[512];
+  uint32_t prefetch_count;
+};
+
+static int part_read_block(void *pa_ptr, uint64_t block_idx,
+                           uint32_t block_count, void *buf) {
+  const struct part_adapter *pa = (const struct part_adapter*)pa_ptr;
+  if (block_idx >= pa->block_count || block_count > pa->block_count -
+      block_idx || !read_abs(pa->args, pa->start_block + block_idx,
+                             block_count, buf)) {
+    memset(buf, '\0', (size_t)block_count << 9);
+    return -1;
+  }
+  return 0;
+}
+
+static const void *part_map_block(void *pa_ptr, uint64_t block_idx,
+                                  uint32_t block_count) {
+  const struct part_adapter *pa = (const struct part_adapter*)pa_ptr;
+  if (block_idx >= pa->block_count ||
+      block_count > pa->block_count - block_idx) return 0;
+  return pa->args->map_block(pa->args->read_block_data,
+                             pa->start_block + block_idx, block_count);
+}
+
+/* Serves the read plan of fsdetect_ex from the shared prefetch buffer. */
+static int part_read_block_list(void *pa_ptr, const uint64_t *block_idxs,
+                                uint32_t block_count, void *buf) {
+  const struct part_adapter *pa = (const struct part_adapter*)pa_ptr;
+  unsigned char *p = (unsigned char*)buf;
+  uint32_t i, j;
+  for (i = 0; i < block_count; ++i, p += 512) {
+    for (j = 0; j < pa->prefetch_count &&
+         pa->prefetch_idxs[j] != pa->start_block + block_idxs[i]; ++j) {}
+    if (j == pa->prefetch_count || block_idxs[i] >= pa->block_count) {
+      return -1;  /* The probes will read the blocks one by one. */
+    }
+    memcpy(p, pa->prefetch_blocks[j], 512);
+  }
+  return 0;
+}
+
+/* Appends a partition to parts. Returns nonzero if parts is full. */
+static char add_part(struct fsdetect_partition *parts, uint32_t max_count,
+                     uint32_t *count, uint32_t number, uint8_t mbr_type,
+                     uint64_t start_block, uint64_t block_count) {
+  struct fsdetect_partition *part;
+  if (*count == max_count) return 1;
+  part = parts + (*count)++;
+  memset(part, '\0', sizeof(*part));
+  part->number = number;
+  part->mbr_type = mbr_type;
+  part->start_block = start_block;
+  part->block_count = block_count;
+  return 0;
+}
+
+/* CRC-32 of the GPT header and partition entry array (IEEE polynomial,
+ * reflected). Bitwise, because it only runs on a few KiB per device.
+ */
+static uint32_t gpt_crc32(uint32_t crc, const unsigned char *p,
+                          uint32_t size) {
+  uint32_t i;
+  for (; size > 0; --size) {
+    crc ^= *p++;
+    for (i = 0; i < 8; ++i) crc = crc >> 1 ^ (0xedb88320U & -(crc & 1));
+  }
+  return crc;
+}
+
+/* Returns the number of partitions, or -1 if the GPT header at block my_lba
+ * or its partition entry array is invalid (including a bad CRC).
+ */
+static int parse_gpt(const struct fsdetect_args *args,
+                     const unsigned char *header, uint64_t my_lba,
+                     struct fsdetect_partition *parts, uint32_t max_count) {
+  unsigned char buf[GPT_READ_BLOCK_COUNT << 9];
+  const unsigned char *entries = 0, *entry;
+  uint64_t entries_block = get64(header + 72), first_block, last_block;
+  const uint32_t header_size = get32(header + 12);
+  const uint32_t entry_count = get32(header + 80);
+  const uint32_t entry_size = get32(header + 84);
+  const uint32_t entries_per_read = sizeof(buf) / entry_size;
+  uint32_t i, block_count, crc, count = 0;
+  if (0 != memcmp(header, "EFI PART", 8) || header_size < 92 ||
+      header_size > 512 || get64(header + 24) != my_lba ||
+      entry_size < 128 || entry_size > 512 ||
+      (entry_size & (entry_size - 1)) != 0 || entries_block < 2 ||
+      entry_count > MAX_GPT_ENTRY_COUNT) return -1;
+  memcpy(buf, header, header_size);
+  memset(buf + 16, '\0', 4);  /* The CRC field itself counts as 0. */
+  if (~gpt_crc32(~(uint32_t)0, buf, header_size) != get32(header + 16)) {
+    return -1;
+  }
+  crc = ~(uint32_t)0;
+  for (i = 0; i < entry_count; ++i) {
+    if (i % entries_per_read == 0) {
+      /* Don't read past the end of the array, the backup header is there. */
+      block_count = ((entry_count - i) * entry_size + 511) >> 9;
+      if (block_count > GPT_READ_BLOCK_COUNT) {
+        block_count = GPT_READ_BLOCK_COUNT;
+      }
+      if (!(entries = read_abs(args, entries_block, block_count, buf))) {
+        return -1;
+      }
+      entries_block += block_count;
+    }
+    entry = entries + (i % entries_per_read) * entry_size;
+    crc = gpt_crc32(crc, entry, entry_size);
+    if (get64(entry) == 0 && get64(entry + 8) == 0) continue;  /* Unused. */
+    first_block = get64(entry + 32);
+    last_block = get64(entry + 40);
+    if (last_block < first_block) continue;
+    /* Keeps going when parts is full, to check the CRC. */
+    add_part(parts, max_count, &count, i + 1, MBR_TYPE_GPT, first_block,
+             last_block - first_block + 1);
+  }
+  return ~crc == get32(header + 88) ? (int)count : -1;
+}
+
+/* Adds the logical partitions in the chain of extended boot records. */
+static void parse_ebr_chain(const struct fsdetect_args *args,
+                            uint64_t extended_start,
+                            struct fsdetect_partition *parts,
+                            uint32_t max_count, uint32_t *count) {
+  unsigned char buf[512];
+  const unsigned char *ebr, *entry;
+  uint64_t ebr_block = extended_start;
+  uint32_t i, number = 5;
+  for (i = 0; i < MAX_EBR_COUNT; ++i) {
+    if (!(ebr = read_abs(args, ebr_block, 1, buf)) ||
+        ebr[0x1fe] != 0x55 || ebr[0x1ff] != 0xaa) return;
+    entry = ebr + MBR_ENTRY_OFS;
+    if (entry[4] != MBR_TYPE_EMPTY && get32(entry + 12) != 0) {
+      if (add_part(parts, max_count, count, number++, entry[4],
+                   ebr_block + get32(entry + 8), get32(entry + 12))) return;
+    }
+    entry += 16;
+    if (!is_mbr_extended(entry[4]) || get32(entry + 8) == 0) return;
+    ebr_block = extended_start + get32(entry + 8);
+  }
+}
+
+/* Returns the number of partitions found, or -1 if block 0 is not a
+ * partition table.
+ */
+static int parse_partitions(const struct fsdetect_args *args,
+                            struct fsdetect_partition *parts,
+                            uint32_t max_count) {
+  unsigned char buf[1024], backup_buf[512];
+  const unsigned char *mbr, *entry, *header;
+  uint64_t backup_lba;
+  uint32_t i, count = 0;
+  char is_gpt = 0;
+  int gpt_count;
+  if (!(mbr = read_abs(args, 0, 2, buf)) ||
+      mbr[0x1fe] != 0x55 || mbr[0x1ff] != 0xaa) return -1;
+  /* A FAT or NTFS boot sector also ends with 55 AA. */
+  if (fsdetect_prefilter(mbr, 0, 0) != 0) return -1;
+  for (i = 0, entry = mbr + MBR_ENTRY_OFS; i < 4; ++i, entry += 16) {
+    if ((entry[0] & 0x7f) != 0) return -1;  /* Status: 0 or 0x80. */
+    if (entry[4] == MBR_TYPE_GPT) is_gpt = 1;
+  }
+  if (is_gpt && (gpt_count = parse_gpt(args, mbr + 512, 1, parts,
+                                        max_count)) >= 0) {
+    return gpt_count;
+  }
+  /* The primary GPT is damaged: try the backup header in the last block,
+   * which the protective MBR entry ends at (unless the disk is too large).
+   */
+  for (i = 0, entry = mbr + MBR_ENTRY_OFS; is_gpt && i < 4; ++i, entry += 16) {
+    if (entry[4] != MBR_TYPE_GPT || get32(entry + 12) == 0 ||
+        get32(entry + 12) == 0xffffffffU) continue;
+    backup_lba = (uint64_t)get32(entry + 8) + get32(entry + 12) - 1;
+    if ((header = read_abs(args, backup_lba, 1, backup_buf)) &&
+        (gpt_count = parse_gpt(args, header, backup_lba, parts,
+                               max_count)) >= 0) return gpt_count;
+  }
+  for (i = 0, entry = mbr + MBR_ENTRY_OFS; i < 4; ++i, entry += 16) {
+    if (entry[4] == MBR_TYPE_EMPTY || entry[4] == MBR_TYPE_GPT ||
+        get32(entry + 12) == 0) continue;
+    if (is_mbr_extended(entry[4])) {
+      parse_ebr_chain(args, get32(entry + 8), parts, max_count, &count);
+    } else if (add_part(parts, max_count, &count, i + 1, entry[4],
+                        get32(entry + 8), get32(entry + 12))) {
+      break;
+    }
+  }
+  return count;
+}
+
+/* Reads the read plan of each partition in parts with a single
+ * read_block_list call. Returns the number of blocks prefetched.
+ */
+static uint32_t prefetch_plans(const struct fsdetect_args *args,
+                               const struct fsdetect_partition *parts,
+                               uint32_t part_count, uint64_t *idxs,
+                               unsigned char (*blocks)[512]) {
+  static const uint64_t plan_block_idxs[PLAN_BLOCK_COUNT] =
+      FSDETECT_PLAN_BLOCK_IDXS;
+  uint64_t idx;
+  uint32_t i, j, k, count = 0;
+  for (i = 0; i < part_count; ++i) {
+    for (j = 0; j < PLAN_BLOCK_COUNT; ++j) {
+      if (plan_block_idxs[j] >= parts[i].block_count) break;
+      idx = parts[i].start_block + plan_block_idxs[j];
+      /* Insertion sort, read_block_list needs increasing block_idxs. */
+      for (k = count; k > 0 && idxs[k - 1] > idx; --k) idxs[k] = idxs[k - 1];
+      if (k > 0 && idxs[k - 1] == idx) {  /* Overlapping partitions. */
+        for (; k < count; ++k) idxs[k] = idxs[k + 1];
+        continue;
+      }
+      idxs[k] = idx;
+      ++count;
+    }
+  }
+  if (count == 0) return 0;
+  FSDETECT_TRACE1(read_list__start, count);
+  if (args->read_block_list(args->read_block_data, idxs, count, blocks) != 0) {
+    FSDETECT_TRACE2(read_list__done, count, -1);
+    return 0;
+  }
+  FSDETECT_TRACE2(read_list__done, count, 0);
+  return count;
+}
+
+/* Adds the stats of a partition to the stats of the whole device: sums the
+ * counters, keeps result 0 if the probe succeeded in any partition,
+ * otherwise the highest result.
+ */
+static void add_part_stats(struct fsdetect_stats *stats,
+                           const struct fsdetect_stats *part_stats) {
+  struct fsdetect_probe_stats *ps;
+  const struct fsdetect_probe_stats *pps;
+  uint32_t probe_idx;
+  for (probe_idx = 0; probe_idx < FSDETECT_PROBE_COUNT; ++probe_idx) {
+    ps = &stats->probes[probe_idx];
+    pps = &part_stats->probes[probe_idx];
+    if (ps->result != 0 && (pps->result == 0 || pps->result > ps->result)) {
+      ps->result = pps->result;
+    }
+    ps->read_count += pps->read_count;
+    ps->miss_block_count += pps->miss_block_count;
+    ps->byte_count += pps->byte_count;
+    ps->elapsed_ns += pps->elapsed_ns;
+  }
+}
+
+void fsdetect_at(const struct fsdetect_args *args, uint64_t start_block,
+                 uint64_t block_count, struct fsdetect_output *fsdo) {
+  struct part_adapter pa;
+  struct fsdetect_args part_args;
+  memset(&part_args, '\0', sizeof(part_args));
+  part_args.map_block = args->map_block ? part_map_block : 0;
+  part_args.read_block64 = part_read_block;
+  part_args.read_block_data = &pa;
+  part_args.clock_ns = args->clock_ns;
+  part_args.scratch = args->scratch;
+  part_args.scratch_size = args->scratch_size;
+  part_args.flags = args->flags;
+  part_args.probe_order = args->probe_order;
+  part_args.btrfs_info = args->btrfs_info;
+  pa.args = args;
+  pa.start_block = start_block;
+  pa.block_count = block_count;
+  pa.prefetch_count = 0;
+  fsdetect_ex(&part_args, fsdo);
+}
+
+int fsdetect_partitions(const struct fsdetect_args *args,
+                        struct fsdetect_partition *parts,
+                        uint32_t max_count) {
+  uint64_t prefetch_idxs[PREFETCH_PART_COUNT * PLAN_BLOCK_COUNT];
+  unsigned char prefetch_blocks[PREFETCH_PART_COUNT * PLAN_BLOCK_COUNT][512];
+  struct part_adapter pa;
+  struct fsdetect_args part_args;
+  struct fsdetect_stats part_stats;
+  uint32_t i, batch_count, probe_idx;
+  const int count = parse_partitions(args, parts, max_count);
+  if (count <= 0) return count;
+  if (args->stats) {
+    memset(args->stats, '\0', sizeof(*args->stats));
+    for (probe_idx = 0; probe_idx < FSDETECT_PROBE_COUNT; ++probe_idx) {
+      args->stats->probes[probe_idx].result = FSDETECT_RESULT_NOT_RUN;
+    }
+  }
+  memset(&part_args, '\0', sizeof(part_args));
+  part_args.map_block = args->map_block ? part_map_block : 0;
+  part_args.read_block64 = part_read_block;
+  part_args.read_block_data = &pa;
+  part_args.clock_ns = args->clock_ns;
+  part_args.scratch = args->scratch;
+  part_args.scratch_size = args->scratch_size;
+  part_args.flags = args->flags;
+  part_args.probe_order = args->probe_order;
+  part_args.stats = args->stats ? &part_stats : 0;
+  part_args.btrfs_info = args->btrfs_info;
+  pa.args = args;
+  pa.prefetch_idxs = prefetch_idxs;
+  pa.prefetch_blocks = (const unsigned char (*)[512])prefetch_blocks;
+  pa.prefetch_count = 0;
+  if (args->read_block_list && !args->map_block) {
+    part_args.read_block_list = part_read_block_list;
+  }
+  for (i = 0; i < (uint32_t)count; ++i) {
+    if (part_args.read_block_list && i % PREFETCH_PART_COUNT == 0) {
+      batch_count = count - i < PREFETCH_PART_COUNT ?
+          count - i : PREFETCH_PART_COUNT;
+      pa.prefetch_count = prefetch_plans(args, parts + i, batch_count,
+                                         prefetch_idxs, prefetch_blocks);
+    }
+    pa.start_block = parts[i].start_block;
+    pa.block_count = parts[i].block_count;
+    fsdetect_ex(&part_args, &parts[i].fsdo);
+    if (args->stats) add_part_stats(args->stats, &part_stats);
+  }
+  return count;
+}
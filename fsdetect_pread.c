@@ -0,0 +1,95 @@
+/* read_block64_t and read_block_list_t callbacks for a file descriptor. */
+
+#if !defined(__XTINY__) && !defined(__TINYC__)
+#define _DEFAULT_SOURCE 1  /* For preadv. */
+#define _FILE_OFFSET_BITS 64  /* Volumes larger than 2 GiB. */
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define HAVE_PREAD 1
+#endif
+
+#include "fsdetect_impl.h"
+
+#ifdef HAVE_PREAD
+int fsdetect_fd_read_block(void *fd_ptr, uint64_t block_idx,
+                           uint32_t block_count, void *buf) {
+  const off_t ofs = (off_t)(block_idx << 9);
+  const size_t size = (size_t)block_count << 9;
+  const int fd = (size_t)fd_ptr;
+  if ((uint64_t)ofs != block_idx << 9 ||
+      pread(fd, buf, size, ofs) != (ssize_t)size) {
+    memset(buf, '\0', size);
+    return -1;
+  }
+  return 0;
+}
+
+/* Maximum number of iovecs fsdetect_fd_read_block_list uses in a preadv
+ * call.
+ */
+#define READ_LIST_IOV_MAX 64
+/* Larger gaps (in blocks) between blocks are not read through. */
+#define READ_LIST_GAP_MAX 256
+
+/* Reads the blocks with a single preadv call per group of blocks closer
+ * than READ_LIST_GAP_MAX to each other. Unrequested blocks between them are
+ * read to (and overwritten in) skipbuf.
+ */
+int fsdetect_fd_read_block_list(void *fd_ptr, const uint64_t *block_idxs,
+                                uint32_t block_count, void *buf) {
+  const int fd = (size_t)fd_ptr;
+  struct iovec iov[READ_LIST_IOV_MAX], *v = iov;
+  char skipbuf[4096], *p = (char*)buf;
+  uint64_t start_idx = block_idxs[0], next_idx = start_idx, gap;
+  uint32_t i;
+  size_t size = 0;
+  for (i = 0; i < block_count; ++i, p += 512) {
+    gap = block_idxs[i] - next_idx;
+    if (gap > READ_LIST_GAP_MAX || (uint64_t)(iov + READ_LIST_IOV_MAX - v) <
+        (gap + (sizeof(skipbuf) >> 9) - 1) / (sizeof(skipbuf) >> 9) + 1) {
+      if (preadv(fd, iov, v - iov, (off_t)start_idx << 9) != (ssize_t)size
+         ) return -1;
+      v = iov;
+      size = 0;
+      start_idx = next_idx = block_idxs[i];
+    }
+    for (gap = block_idxs[i] - next_idx; gap > 0; gap -= v++->iov_len >> 9) {
+      v->iov_base = skipbuf;
+      v->iov_len = (gap > sizeof(skipbuf) >> 9 ? sizeof(skipbuf) >> 9 : gap) << 9;
+      size += v->iov_len;
+    }
+    v->iov_base = p;
+    v++->iov_len = 512;
+    size += 512;
+    next_idx = block_idxs[i] + 1;
+  }
+  if (preadv(fd, iov, v - iov, (off_t)start_idx << 9) != (ssize_t)size
+     ) return -1;
+  return 0;
+}
+#else
+#ifdef __TINYC__  /* xtiny.h has these. */
+typedef long off_t;
+typedef int ssize_t;
+extern off_t lseek(int __fd, off_t __offset, int __whence) __attribute__ ((__nothrow__));
+extern ssize_t read(int __fd, void *__buf, size_t __nbytes) ;
+#define SEEK_SET 0
+#endif
+
+/* No pread in xtiny, so this one moves the file offset: not reentrant. */
+int fsdetect_fd_read_block(void *fd_ptr, uint64_t block_idx,
+                           uint32_t block_count, void *buf) {
+  const off_t ofs = (off_t)(block_idx << 9);
+  const size_t size = (size_t)block_count << 9;
+  const int fd = (size_t)fd_ptr;
+  /* The 1st check fails if off_t is 32 bits (xtiny, tcc). */
+  if ((uint64_t)ofs != block_idx << 9 ||
+      ofs != lseek(fd, ofs, SEEK_SET)) { err:
+    memset(buf, '\0', size);
+    return -1;
+  }
+  if (size != (size_t)read(fd, buf, size)) goto err;
+  return 0;
+}
+#endif
@@ -0,0 +1,53 @@
+#include "fsdetect_impl.h"
+
+/* memcpy is inlined to a single unaligned load by gcc -O2. */
+static __inline__ uint64_t load64(const unsigned char *p) {
+  uint64_t x;
+  memcpy(&x, p, 8);
+  return x;
+}
+
+static __inline__ uint16_t load16(const unsigned char *p) {
+  uint16_t x;
+  memcpy(&x, p, 2);
+  return x;
+}
+
+/* All comparisons are evaluated (no short-circuit && or ||), and the
+ * results are combined with bitwise operators, so there are no
+ * unpredictable branches.
+ */
+uint32_t fsdetect_prefilter(const unsigned char *block0,
+                            const unsigned char *block2,
+                            const unsigned char *block128) {
+  uint32_t mask = 0;
+  if (block0) {
+    const uint64_t oem_id = load64(block0 + 3);
+    const uint32_t has_boot_signature =
+        load16(block0 + 0x1fe) == load16((const unsigned char*)"\x55\xaa");
+    /* Same as in fsdetect_fat: a jump instruction, and an extended boot
+     * signature at the FAT12/FAT16 or the FAT32 offset.
+     */
+    const uint32_t is_fat =
+        ((block0[0] == 0xeb) & (block0[2] == 0x90)) |
+        ((block0[0] == 0xe9) & (block0[2] <= 1));
+    const uint32_t has_fat_ext_signature =
+        (block0[0x26] == 0x29) | (block0[0x42] == 0x29);
+    const uint32_t is_ntfs =
+        (oem_id == load64((const unsigned char*)"NTFS    ")) |
+        (oem_id == load64((const unsigned char*)"MSWIN4.0")) |
+        (oem_id == load64((const unsigned char*)"MSWIN4.1"));
+    mask |= (is_fat & has_fat_ext_signature & has_boot_signature) *
+            FSDETECT_PROBE_FAT;
+    mask |= (is_ntfs & has_boot_signature) * FSDETECT_PROBE_NTFS;
+  }
+  if (block2) {
+    mask |= (load16(block2 + 0x38) == load16((const unsigned char*)"\x53\xef")
+            ) * FSDETECT_PROBE_EXT;
+  }
+  if (block128) {
+    mask |= (load64(block128 + 0x40) ==
+             load64((const unsigned char*)"_BHRfS_M")) * FSDETECT_PROBE_BTRFS;
+  }
+  return mask;
+}
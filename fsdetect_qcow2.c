@@ -0,0 +1,191 @@
+#include "fsdetect_tool.h"
+
+#ifdef HAVE_QCOW2
+#include <fcntl.h>
+#include <stdlib.h>
+
+/* https://gitlab.com/qemu-project/qemu/-/blob/master/docs/interop/qcow2.txt */
+#define QCOW2_HEADER_SIZE 104
+#define QCOW2_OFFSET_MASK (((uint64_t)1 << 56) - 512)  /* Bits 9 .. 55. */
+#define QCOW2_L2_COMPRESSED ((uint64_t)1 << 62)
+#define QCOW2_L2_ZERO 1  /* Version 3 only. */
+/* Incompatible features we can't read: external data file, extended L2
+ * entries. The dirty and corrupt bits don't matter for reading.
+ */
+#define QCOW2_INCOMPAT_UNSUPPORTED (~(uint64_t)3)
+
+static uint32_t get_be32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+      p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+  return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+/* Reads the big-endian 64-bit table entry at ofs. Returns 0 on error. */
+static uint64_t read_entry(int fd, uint64_t ofs) {
+  unsigned char buf[8];
+  return pread(fd, buf, 8, ofs) == 8 ? get_be64(buf) : 0;
+}
+
+static int qcow2_open_chain(struct qcow2_image *qi, int fd, const char *path,
+                            uint32_t depth);
+
+/* Opens the backing file name (relative to the directory of path), as
+ * qcow2 or raw.
+ */
+static struct qcow2_image *open_backing(const char *path, const char *name,
+                                        uint32_t name_size, uint32_t depth) {
+  struct qcow2_image *qi;
+  const char *slash = 0, *p;
+  char *backing_path;
+  size_t dir_size;
+  int fd, result;
+  for (p = path; *p; ++p) {
+    if (*p == '/') slash = p;
+  }
+  dir_size = name[0] != '/' && slash ? (size_t)(slash + 1 - path) : 0;
+  if (!(backing_path = (char*)malloc(dir_size + name_size + 1))) return 0;
+  memcpy(backing_path, path, dir_size);
+  memcpy(backing_path + dir_size, name, name_size);
+  backing_path[dir_size + name_size] = '\0';
+  qi = 0;
+  if ((fd = open(backing_path, O_RDONLY)) >= 0) {
+    if (!(qi = (struct qcow2_image*)malloc(sizeof(*qi)))) {
+      close(fd);
+    } else if ((result = qcow2_open_chain(qi, fd, backing_path, depth + 1)
+               ) == -1) {  /* Not qcow2. */
+      memset(qi, '\0', sizeof(*qi));
+      qi->fd = fd;
+      qi->is_raw = 1;
+    } else if (result != 0) {
+      close(fd);
+      free(qi);
+      qi = 0;
+    }
+  }
+  free(backing_path);
+  return qi;
+}
+
+/* Returns -1 if fd is not a qcow2 image, -2 if it's not supported (or a
+ * backing file is missing).
+ */
+static int qcow2_open_chain(struct qcow2_image *qi, int fd, const char *path,
+                            uint32_t depth) {
+  unsigned char header[QCOW2_HEADER_SIZE];
+  char name[1024];
+  uint64_t backing_ofs;
+  uint32_t version, backing_size;
+  if (pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      0 != memcmp(header, "QFI\xfb", 4)) return -1;
+  if (depth >= QCOW2_MAX_CHAIN) return -2;  /* Maybe a loop. */
+  memset(qi, '\0', sizeof(*qi));
+  qi->fd = fd;
+  version = get_be32(header + 4);
+  backing_ofs = get_be64(header + 8);
+  backing_size = get_be32(header + 16);
+  qi->cluster_bits = get_be32(header + 20);
+  qi->size = get_be64(header + 24);
+  qi->l1_size = get_be32(header + 36);
+  qi->l1_table_offset = get_be64(header + 40);
+  qi->is_v3 = version >= 3;
+  if ((version != 2 && version != 3) || qi->cluster_bits < 9 ||
+      qi->cluster_bits > 21 || get_be32(header + 32) != 0 ||  /* Encrypted. */
+      (qi->is_v3 && (get_be64(header + 72) & QCOW2_INCOMPAT_UNSUPPORTED))
+     ) return -2;
+  if (backing_ofs != 0) {
+    if (backing_size == 0 || backing_size > sizeof(name) ||
+        pread(fd, name, backing_size, backing_ofs) != (ssize_t)backing_size ||
+        !(qi->backing = open_backing(path, name, backing_size, depth))
+       ) return -2;
+  }
+  return 0;
+}
+
+int qcow2_open(struct qcow2_image *qi, int fd, const char *path) {
+  return qcow2_open_chain(qi, fd, path, 0);
+}
+
+void qcow2_close(struct qcow2_image *qi) {
+  struct qcow2_image *backing = qi->backing, *next;
+  for (; backing; backing = next) {
+    next = backing->backing;
+    close(backing->fd);
+    free(backing);
+  }
+}
+
+/* Returns the L2 entry of guest cluster cluster_idx (0: unallocated), from
+ * the entry cache if possible. Reads only the 8-byte L1 and L2 entries,
+ * not whole tables.
+ */
+static uint64_t get_l2_entry(struct qcow2_image *qi, uint64_t cluster_idx) {
+  struct qcow2_cache_entry *ce =
+      qi->l2_cache + cluster_idx % QCOW2_CACHE_SIZE;
+  const uint32_t l2_bits = qi->cluster_bits - 3;
+  const uint64_t l1_idx = cluster_idx >> l2_bits;
+  uint64_t l2_offset;
+  if (ce->is_valid && ce->cluster_idx == cluster_idx) return ce->entry;
+  if (l1_idx >= qi->l1_size) return 0;
+  if (qi->l1_cache_idx != l1_idx + 1) {  /* 0 means empty. */
+    qi->l1_entry = read_entry(qi->fd, qi->l1_table_offset + (l1_idx << 3));
+    qi->l1_cache_idx = l1_idx + 1;
+  }
+  ce->cluster_idx = cluster_idx;
+  ce->is_valid = 1;
+  ce->entry = (l2_offset = qi->l1_entry & QCOW2_OFFSET_MASK) == 0 ? 0 :
+      read_entry(qi->fd, l2_offset +
+                 ((cluster_idx & (((uint64_t)1 << l2_bits) - 1)) << 3));
+  return ce->entry;
+}
+
+/* Reads size bytes at guest offset ofs, within a single cluster. */
+static int read_cluster_part(struct qcow2_image *qi, uint64_t ofs,
+                             uint32_t size, unsigned char *buf) {
+  uint64_t entry, host_ofs;
+  ssize_t got;
+  if (qi->is_raw) {  /* Past EOF of a raw backing file reads as zeros. */
+    if ((got = pread(qi->fd, buf, size, ofs)) < 0) return -1;
+    memset(buf + got, '\0', size - got);
+    return 0;
+  }
+  if (ofs >= qi->size) {  /* Shorter backing file. */
+    memset(buf, '\0', size);
+    return 0;
+  }
+  entry = get_l2_entry(qi, ofs >> qi->cluster_bits);
+  if (entry & QCOW2_L2_COMPRESSED) return -1;  /* Needs zlib. */
+  if ((host_ofs = entry & QCOW2_OFFSET_MASK) == 0 && qi->backing &&
+      !(qi->is_v3 && (entry & QCOW2_L2_ZERO))) {
+    return read_cluster_part(qi->backing, ofs, size, buf);
+  }
+  if (host_ofs == 0 || (qi->is_v3 && (entry & QCOW2_L2_ZERO))) {
+    memset(buf, '\0', size);  /* Unallocated or zero cluster, no I/O. */
+    return 0;
+  }
+  host_ofs += ofs & (((uint64_t)1 << qi->cluster_bits) - 1);
+  return pread(qi->fd, buf, size, host_ofs) == (ssize_t)size ? 0 : -1;
+}
+
+int qcow2_read_block(void *qi_ptr, uint64_t block_idx,
+                     uint32_t block_count, void *buf) {
+  struct qcow2_image *qi = (struct qcow2_image*)qi_ptr;
+  const uint64_t cluster_size = (uint64_t)1 << qi->cluster_bits;
+  uint64_t ofs = block_idx << 9, part_size;
+  const size_t size = (size_t)block_count << 9;
+  unsigned char *p = (unsigned char*)buf, *end = p + size;
+  if (block_idx >= qi->size >> 9 || block_count > (qi->size >> 9) - block_idx
+     ) goto err;
+  for (; p != end; p += part_size, ofs += part_size) {
+    part_size = cluster_size - (ofs & (cluster_size - 1));
+    if (part_size > (uint64_t)(end - p)) part_size = end - p;
+    if (read_cluster_part(qi, ofs, (uint32_t)part_size, p) != 0) { err:
+      memset(buf, '\0', size);
+      return -1;
+    }
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,147 @@
+/* Persistent result cache of batch mode (fsdetect -C <file>).
+ *
+ * The file has a 16-byte header, then one record per device: struct
+ * rcache_record, followed by the path (path_size bytes including the
+ * trailing NUL). It's in native byte order, because it's only read on the
+ * same host.
+ */
+
+#include "fsdetect_tool.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+static const char rcache_header[16] = "fsdetect-rc 1\n\0";
+
+struct rcache_record {
+  struct rcache_key key;
+  struct fsdetect_fingerprint fp;
+  struct fsdetect_output fsdo;
+  uint32_t path_size;
+};
+
+static int compare_entries(const void *a, const void *b) {
+  return strcmp(((const struct rcache_entry*)a)->path,
+                ((const struct rcache_entry*)b)->path);
+}
+
+int rcache_get_key(int fd, struct rcache_key *key) {
+  struct stat st;
+  off_t size;
+  if (fstat(fd, &st) != 0) return -1;
+  memset(key, '\0', sizeof(*key));
+  if (S_ISBLK(st.st_mode)) {
+    /* The size and the mtime of a device node don't change on write. */
+    key->dev = st.st_rdev;
+    if ((size = lseek(fd, 0, SEEK_END)) < 0) return -1;
+    key->size = size;
+  } else {
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000 +
+                    st.st_mtim.tv_nsec;
+  }
+  return 0;
+}
+
+struct rcache *rcache_load(const char *filename, char **paths,
+                           uint32_t path_count) {
+  struct rcache *rc;
+  struct rcache_entry key, *e;
+  struct rcache_record record;
+  const char *p, *end;
+  size_t size = 0;
+  uint32_t i, loaded_count;
+  const int fd = open(filename, O_RDONLY);
+  if (!(rc = (struct rcache*)malloc(sizeof(*rc)))) return 0;
+  rc->filename = filename;
+  rc->data = 0;
+  if (fd >= 0) {  /* A missing or invalid cache file is just empty. */
+    rc->data = read_all(fd, &size);
+    close(fd);
+  }
+  if (!rc->data || size < sizeof(rcache_header) ||
+      0 != memcmp(rc->data, rcache_header, sizeof(rcache_header))) size = 0;
+  /* At most this many records fit. */
+  loaded_count = size / (sizeof(record) + 2);
+  if (!(rc->entries = (struct rcache_entry*)malloc(
+      (loaded_count + path_count + 1) * sizeof(*rc->entries)))) {
+    free(rc->data);
+    free(rc);
+    return 0;
+  }
+  e = rc->entries;
+  if (size != 0) {
+    for (p = rc->data + sizeof(rcache_header), end = rc->data + size;
+         (size_t)(end - p) >= sizeof(record); ++e) {
+      memcpy(&record, p, sizeof(record));
+      p += sizeof(record);
+      if (record.path_size < 2 || (size_t)(end - p) < record.path_size ||
+          p[record.path_size - 1] != '\0') break;  /* Truncated. */
+      e->key = record.key;
+      e->fp = record.fp;
+      e->fsdo = record.fsdo;
+      e->path = p;
+      e->is_valid = 1;
+      e->is_used = 0;
+      p += record.path_size;
+    }
+  }
+  loaded_count = rc->entry_count = e - rc->entries;
+  qsort(rc->entries, loaded_count, sizeof(*rc->entries), compare_entries);
+  for (i = 0; i < path_count; ++i) {
+    key.path = paths[i];
+    if (!bsearch(&key, rc->entries, loaded_count, sizeof(*rc->entries),
+                 compare_entries)) {
+      e = rc->entries + rc->entry_count++;
+      e->path = paths[i];
+      e->is_valid = e->is_used = 0;
+    }
+  }
+  qsort(rc->entries, rc->entry_count, sizeof(*rc->entries), compare_entries);
+  return rc;
+}
+
+struct rcache_entry *rcache_find(struct rcache *rc, const char *path) {
+  struct rcache_entry key;
+  key.path = path;
+  return (struct rcache_entry*)bsearch(&key, rc->entries, rc->entry_count,
+                                       sizeof(*rc->entries), compare_entries);
+}
+
+int rcache_save(struct rcache *rc) {
+  char tmp_filename[4096];
+  struct rcache_record record;
+  const struct rcache_entry *e;
+  FILE *f;
+  int is_error;
+  if (strlen(rc->filename) + 5 > sizeof(tmp_filename)) return -1;
+  strcpy(tmp_filename, rc->filename);
+  strcat(tmp_filename, ".tmp");
+  if (!(f = fopen(tmp_filename, "wb"))) return -1;
+  fwrite(rcache_header, 1, sizeof(rcache_header), f);
+  for (e = rc->entries; e != rc->entries + rc->entry_count; ++e) {
+    if (!e->is_valid) continue;
+    memset(&record, '\0', sizeof(record));  /* No uninitialized padding. */
+    record.key = e->key;
+    record.fp = e->fp;
+    record.fsdo = e->fsdo;
+    record.path_size = strlen(e->path) + 1;
+    fwrite(&record, 1, sizeof(record), f);
+    fwrite(e->path, 1, record.path_size, f);
+  }
+  is_error = ferror(f);
+  if (fclose(f) != 0 || is_error || rename(tmp_filename, rc->filename) != 0) {
+    remove(tmp_filename);
+    return -1;
+  }
+  return 0;
+}
+
+void rcache_free(struct rcache *rc) {
+  free(rc->entries);
+  free(rc->data);
+  free(rc);
+}
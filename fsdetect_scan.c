@@ -0,0 +1,160 @@
+/* Carving mode: finds filesystems at any 512-byte-aligned offset of a large
+ * image, on multiple threads.
+ *
+ * The image is split to chunks, each worker thread reads whole chunks with
+ * pread, finds the candidates with fsdetect_carve, and verifies them with
+ * fsdetect_at (using the full probes) on its own file descriptor.
+ */
+
+#include "fsdetect_tool.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#define SCAN_CHUNK_BLOCKS 8192  /* 4 MiB. */
+
+struct scan {
+  const char *path;
+  uint64_t block_count;  /* Size of the image. */
+  uint64_t next_block_idx;  /* Start of the next chunk to scan. */
+  struct scan_result *results;
+  uint32_t result_count;
+  uint32_t result_capacity;
+  char is_error;
+  pthread_mutex_t mutex;
+};
+
+static int compare_candidates(const void *a, const void *b) {
+  const uint64_t x = ((const struct fsdetect_candidate*)a)->start_block;
+  const uint64_t y = ((const struct fsdetect_candidate*)b)->start_block;
+  return x < y ? -1 : x > y;
+}
+
+static int compare_results(const void *a, const void *b) {
+  const uint64_t x = ((const struct scan_result*)a)->start_block;
+  const uint64_t y = ((const struct scan_result*)b)->start_block;
+  return x < y ? -1 : x > y;
+}
+
+/* Verifies the candidates in a chunk, and adds the filesystems found. */
+static void verify_candidates(struct scan *scan, int fd,
+                              struct fsdetect_candidate *candidates,
+                              uint32_t candidate_count) {
+  struct fsdetect_args args;
+  struct scan_result result, *new_results;
+  uint32_t i;
+  memset(&args, '\0', sizeof(args));
+  args.read_block64 = fsdetect_fd_read_block;  /* Only this thread uses fd. */
+  args.read_block_data = (void*)(size_t)fd;
+  /* A filesystem can have several signatures (e.g. FAT and ext) in the
+   * chunk, verify each start once.
+   */
+  qsort(candidates, candidate_count, sizeof(*candidates), compare_candidates);
+  for (i = 0; i < candidate_count; ++i) {
+    if (i > 0 && candidates[i].start_block == candidates[i - 1].start_block) {
+      continue;
+    }
+    result.start_block = candidates[i].start_block;
+    fsdetect_at(&args, result.start_block,
+                scan->block_count - result.start_block, &result.fsdo);
+    if (result.fsdo.fstype[0] == '?') continue;  /* False positive. */
+    pthread_mutex_lock(&scan->mutex);
+    if (scan->result_count == scan->result_capacity) {
+      if ((new_results = (struct scan_result*)realloc(scan->results,
+          (scan->result_capacity * 2 + 16) * sizeof(*new_results))) == 0) {
+        scan->is_error = 1;
+        pthread_mutex_unlock(&scan->mutex);
+        return;
+      }
+      scan->results = new_results;
+      scan->result_capacity = scan->result_capacity * 2 + 16;
+    }
+    scan->results[scan->result_count++] = result;
+    pthread_mutex_unlock(&scan->mutex);
+  }
+}
+
+static void *scan_worker(void *scan_ptr) {
+  struct scan *scan = (struct scan*)scan_ptr;
+  const int fd = open(scan->path, O_RDONLY);
+  char *chunk = (char*)malloc(SCAN_CHUNK_BLOCKS << 9);
+  struct fsdetect_candidate *candidates = (struct fsdetect_candidate*)malloc(
+      3 * SCAN_CHUNK_BLOCKS * sizeof(*candidates));
+  uint64_t block_idx;
+  uint32_t block_count;
+  ssize_t got;
+  if (fd < 0 || !chunk || !candidates) {
+    pthread_mutex_lock(&scan->mutex);
+    scan->is_error = 1;
+    pthread_mutex_unlock(&scan->mutex);
+    goto done;
+  }
+  for (;;) {
+    pthread_mutex_lock(&scan->mutex);
+    block_idx = scan->next_block_idx;
+    if (block_idx < scan->block_count && !scan->is_error) {
+      scan->next_block_idx += SCAN_CHUNK_BLOCKS;
+    } else {
+      block_idx = scan->block_count;
+    }
+    pthread_mutex_unlock(&scan->mutex);
+    if (block_idx == scan->block_count) break;
+    block_count = scan->block_count - block_idx < SCAN_CHUNK_BLOCKS ?
+        scan->block_count - block_idx : SCAN_CHUNK_BLOCKS;
+    if ((got = pread(fd, chunk, (size_t)block_count << 9,
+                     (off_t)block_idx << 9)) < 0) got = 0;
+    block_count = got >> 9;  /* Short read: scan what we have. */
+    verify_candidates(scan, fd, candidates, fsdetect_carve(
+        chunk, block_count, block_idx, candidates));
+  }
+ done:
+  free(candidates);
+  free(chunk);
+  if (fd >= 0) close(fd);
+  return 0;
+}
+
+struct scan_result *scan_run(const char *path, uint32_t thread_count,
+                             uint32_t *result_count_out) {
+  struct scan scan;
+  pthread_t threads[SCAN_MAX_THREADS];
+  uint32_t i, j;
+  off_t size;
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  size = lseek(fd, 0, SEEK_END);
+  close(fd);
+  if (size < 0) return 0;
+  scan.path = path;
+  scan.block_count = (uint64_t)size >> 9;
+  scan.next_block_idx = 0;
+  scan.results = 0;
+  scan.result_count = scan.result_capacity = 0;
+  scan.is_error = 0;
+  pthread_mutex_init(&scan.mutex, 0);
+  if (thread_count > SCAN_MAX_THREADS) thread_count = SCAN_MAX_THREADS;
+  for (i = 0; i < thread_count; ++i) {
+    if (pthread_create(threads + i, 0, scan_worker, &scan) != 0) break;
+  }
+  if (i == 0) scan_worker(&scan);  /* -j 0, or pthread_create failed. */
+  for (j = 0; j < i; ++j) {
+    pthread_join(threads[j], 0);
+  }
+  pthread_mutex_destroy(&scan.mutex);
+  if (scan.is_error) {
+    free(scan.results);
+    return 0;
+  }
+  /* A start can be found in 2 chunks (e.g. its ext superblock is in the
+   * next chunk).
+   */
+  qsort(scan.results, scan.result_count, sizeof(*scan.results),
+        compare_results);
+  for (i = j = 0; i < scan.result_count; ++i) {
+    if (j == 0 || scan.results[i].start_block !=
+        scan.results[j - 1].start_block) scan.results[j++] = scan.results[i];
+  }
+  *result_count_out = j;
+  if (!scan.results) scan.results = (struct scan_result*)malloc(1);
+  return scan.results;
+}
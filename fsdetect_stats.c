@@ -0,0 +1,49 @@
+#include "fsdetect_impl.h"
+
+static const char probe_names[FSDETECT_PROBE_COUNT][6] = {
+    "fat", "ext", "ntfs", "btrfs" };
+
+const char *fsdetect_probe_name(uint32_t probe_idx) {
+  return probe_idx < FSDETECT_PROBE_COUNT ? probe_names[probe_idx] : "?";
+}
+
+void fsdetect_stats_add(struct fsdetect_stats_total *total,
+                        const struct fsdetect_stats *stats) {
+  const struct fsdetect_probe_stats *ps;
+  struct fsdetect_probe_stats_total *pt;
+  uint32_t probe_idx;
+  int result;
+  ++total->detection_count;
+  for (probe_idx = 0; probe_idx < FSDETECT_PROBE_COUNT; ++probe_idx) {
+    ps = &stats->probes[probe_idx];
+    pt = &total->probes[probe_idx];
+    result = ps->result;
+    if (result > FSDETECT_RESULT_FILTERED) ++pt->run_count;
+    if (result < -FSDETECT_RESULT_BIAS) result = -FSDETECT_RESULT_BIAS;
+    if (result >= FSDETECT_RESULT_LIMIT) result = FSDETECT_RESULT_LIMIT - 1;
+    ++pt->result_counts[result + FSDETECT_RESULT_BIAS];
+    pt->read_count += ps->read_count;
+    pt->miss_block_count += ps->miss_block_count;
+    pt->byte_count += ps->byte_count;
+    pt->elapsed_ns += ps->elapsed_ns;
+  }
+}
+
+void fsdetect_probe_order(const struct fsdetect_stats_total *total,
+                          uint8_t *order) {
+  uint64_t costs[FSDETECT_PROBE_COUNT], cost;
+  uint32_t probe_idx, hit_count, i;
+  for (probe_idx = 0; probe_idx < FSDETECT_PROBE_COUNT; ++probe_idx) {
+    hit_count = total->probes[probe_idx].result_counts[FSDETECT_RESULT_BIAS];
+    /* + 1: without a clock, the probes with the most successes first. */
+    cost = hit_count == 0 ? ~(uint64_t)0 :
+        (total->probes[probe_idx].elapsed_ns + 1) / hit_count;
+    /* Stable insertion sort. */
+    for (i = probe_idx; i > 0 && costs[i - 1] > cost; --i) {
+      costs[i] = costs[i - 1];
+      order[i] = order[i - 1];
+    }
+    costs[i] = cost;
+    order[i] = (uint8_t)probe_idx;
+  }
+}
@@ -0,0 +1,313 @@
+#ifndef _FSDETECT_TOOL_H
+#define _FSDETECT_TOOL_H 1
+
+/* Declarations shared by the source files of the fsdetect command-line
+ * tool. Not part of the library.
+ */
+
+#ifdef __XTINY__
+#include <xtiny.h>
+#else
+#ifdef __TINYC__
+typedef long off_t;
+typedef unsigned int size_t;
+typedef int ssize_t;
+extern off_t lseek(int __fd, off_t __offset, int __whence) __attribute__ ((__nothrow__));
+extern void *memset(void *__s, int __c, size_t __n) __attribute__ ((__nothrow__)) __attribute__ ((__nonnull__ (1)));
+extern ssize_t read(int __fd, void *__buf, size_t __nbytes) ;
+extern size_t strlen(__const char *__s) __attribute__ ((__nothrow__)) __attribute__ ((__pure__)) __attribute__ ((__nonnull__ (1)));
+extern void *memcpy(void *__restrict __dest, __const void *__restrict __src, size_t __n) __attribute__ ((__nothrow__)) __attribute__ ((__nonnull__ (1, 2)));
+extern ssize_t write(int __fd, __const void *__buf, size_t __n) ;
+#define SEEK_SET 0
+#else
+#define _DEFAULT_SOURCE 1  /* For preadv. */
+#define _FILE_OFFSET_BITS 64  /* Volumes larger than 2 GiB. */
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+/* The full build has more features than the xtiny and tcc builds. The .min
+ * builds (FSDETECT_TOOL_MIN) have only the stdin mode, like xtiny.
+ */
+#define HAVE_PREADV 1
+#ifndef FSDETECT_TOOL_MIN
+#define HAVE_MMAP 1
+#define HAVE_BATCH 1
+#define HAVE_QCOW2 1
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#endif
+#if __has_include(<sys/inotify.h>) && __has_include(<linux/netlink.h>)
+#define HAVE_DAEMON 1
+#endif
+#if __has_include(<linux/fs.h>)
+#define HAVE_DIRECT 1
+#endif
+#endif
+#endif
+#endif
+#endif
+#include "fsdetect.h"
+
+/* Default of stream_detect limit_block_count: 4 GiB, which covers the NTFS
+ * MFT at 3 GiB, where mkntfs puts it on large volumes.
+ */
+#define STREAM_LIMIT_BLOCK_COUNT ((uint64_t)8 << 20)
+
+/* Detects from a non-seekable fd (e.g. a pipe), reading forward only, and
+ * only as far as the probes need, but at most limit_block_count blocks.
+ * The read callbacks of args are ignored. Blocks it can't read (past EOF
+ * or the limit, or behind the current position) fail like read errors.
+ * Uses about 450 KiB of stack.
+ */
+void stream_detect(int fd, uint64_t limit_block_count,
+                   const struct fsdetect_args *args,
+                   struct fsdetect_output *fsdo);
+
+#ifdef HAVE_MMAP
+/* A read-only memory mapping of a whole regular file. */
+struct mmap_file {
+  const unsigned char *base;
+  uint64_t size;
+};
+
+/* Maps the regular file fd. Returns nonzero if fd is not a nonempty
+ * regular file, or it can't be mapped.
+ */
+int mmap_file_open(struct mmap_file *mf, int fd);
+void mmap_file_close(struct mmap_file *mf);
+/* map_block_t callback, pass a struct mmap_file* as fd_ptr. */
+const void *mmap_map_block(void *mf_ptr, uint64_t block_idx,
+                           uint32_t block_count);
+#endif
+
+#ifdef HAVE_QCOW2
+#define QCOW2_MAX_CHAIN 16  /* Maximum depth of backing files. */
+#define QCOW2_CACHE_SIZE 16  /* Cached L2 entries. */
+
+struct qcow2_cache_entry {
+  uint64_t cluster_idx;
+  uint64_t entry;
+  char is_valid;
+};
+
+/* A qcow2 image (version 2 or 3), or a raw backing file. */
+struct qcow2_image {
+  int fd;
+  char is_raw;
+  char is_v3;
+  uint32_t cluster_bits;
+  uint32_t l1_size;
+  uint64_t size;  /* Virtual size in bytes. */
+  uint64_t l1_table_offset;
+  uint64_t l1_cache_idx;  /* Index + 1 of the L1 entry in l1_entry. */
+  uint64_t l1_entry;
+  struct qcow2_cache_entry l2_cache[QCOW2_CACHE_SIZE];
+  struct qcow2_image *backing;  /* malloc()ed, or NULL. */
+};
+
+/* Opens the qcow2 image fd, and its chain of backing files (relative to
+ * the directory of path). Returns nonzero if fd is not a qcow2 image or it
+ * can't be read: encrypted, external data file, extended L2 entries,
+ * missing backing file. Reads only the header.
+ */
+int qcow2_open(struct qcow2_image *qi, int fd, const char *path);
+/* Closes the backing files, but not the fd passed to qcow2_open. */
+void qcow2_close(struct qcow2_image *qi);
+/* read_block64_t callback, pass a struct qcow2_image* as fd_ptr. Reads
+ * only the L1 and L2 entries it needs (8 bytes each, with a small cache),
+ * and unallocated clusters read as zeros (or from the backing file)
+ * without data I/O. Compressed clusters are read errors.
+ */
+int qcow2_read_block(void *qi_ptr, uint64_t block_idx,
+                     uint32_t block_count, void *buf);
+#endif
+
+#ifdef HAVE_DIRECT
+/* Size of each buffer in the pool of a direct_reader. */
+#define DIRECT_BUF_SIZE (64 << 10)
+#define DIRECT_BUF_COUNT 8
+/* Alignment of the buffers, and the minimum read size. */
+#define DIRECT_ALIGN 4096
+
+/* Reader of a file descriptor opened with O_DIRECT (bypassing the page
+ * cache), in whole logical sectors (512 or 4096 bytes) to aligned buffers.
+ */
+struct direct_reader {
+  int fd;
+  uint32_t align;  /* max(logical sector size, DIRECT_ALIGN). */
+  unsigned char *pool;  /* DIRECT_BUF_COUNT * DIRECT_BUF_SIZE bytes. */
+  struct direct_buf {
+    uint64_t ofs;  /* Offset of the data on the device. */
+    uint32_t size;  /* 0 if empty. */
+    uint32_t last_use;
+  } bufs[DIRECT_BUF_COUNT];
+  uint32_t use_count;
+};
+
+/* Allocates a pool for direct_init, aligned to DIRECT_ALIGN. Returns NULL
+ * on out of memory. Free it with free().
+ */
+unsigned char *direct_pool_alloc(void);
+/* Opens path with O_DIRECT. Returns -1 on error (e.g. the filesystem
+ * doesn't support O_DIRECT).
+ */
+int direct_open(const char *path);
+/* Queries the logical sector size of fd (BLKSSZGET, DIRECT_ALIGN for
+ * regular files) and empties the buffers.
+ */
+void direct_init(struct direct_reader *dr, int fd, unsigned char *pool);
+/* read_block64_t callback, pass a struct direct_reader* as fd_ptr. Serves
+ * the 512-byte blocks from the buffers, and reads the aligned sectors
+ * around them (at least DIRECT_ALIGN bytes) to the least recently used
+ * buffer on a miss.
+ */
+int direct_read_block(void *dr_ptr, uint64_t block_idx,
+                      uint32_t block_count, void *buf);
+#endif
+
+#ifdef HAVE_BATCH
+/* Reads all data from fd to a NUL-terminated, malloc()ed buffer. */
+char *read_all(int fd, size_t *size_out);
+/* Appends the block devices (e.g. /dev/sda1, from /sys/class/block) to
+ * *paths (malloc()ed, and so is each path). With is_files, appends the
+ * regular files in dir instead.
+ */
+void list_dir(const char *dir, char is_files, char ***paths,
+              uint32_t *path_count, uint32_t *capacity);
+
+/* Identity of a device or image in the result cache. */
+struct rcache_key {
+  uint64_t dev;  /* st_rdev of block devices, st_dev of files. */
+  uint64_t ino;  /* 0 for block devices. */
+  uint64_t size;
+  uint64_t mtime_ns;  /* 0 for block devices. */
+};
+
+struct rcache_entry {
+  const char *path;
+  struct rcache_key key;
+  struct fsdetect_fingerprint fp;
+  struct fsdetect_output fsdo;
+  char is_valid;  /* The fields other than path are set. */
+  char is_used;  /* A batch_item points to it. */
+};
+
+/* Result cache, loaded from a file, with an entry for each path. */
+struct rcache {
+  const char *filename;
+  char *data;  /* Contents of the file, the paths point into it. */
+  struct rcache_entry *entries;  /* Sorted by path. */
+  uint32_t entry_count;
+};
+
+/* Loads the result cache from filename (missing or invalid: empty), and
+ * adds an invalid entry for each of paths not in it yet. Returns NULL on
+ * out of memory.
+ */
+struct rcache *rcache_load(const char *filename, char **paths,
+                           uint32_t path_count);
+struct rcache_entry *rcache_find(struct rcache *rc, const char *path);
+/* Writes the valid entries to the file atomically. */
+int rcache_save(struct rcache *rc);
+void rcache_free(struct rcache *rc);
+int rcache_get_key(int fd, struct rcache_key *key);
+
+/* For the flags of batch_start. */
+#define BATCH_MMAP 1  /* Use mmap_map_block for regular files. */
+#define BATCH_PARTITIONS 2  /* Detect in each partition with fsdetect_partitions. */
+#define BATCH_VERIFY_CSUM 4  /* FSDETECT_VERIFY_CSUM. */
+#define BATCH_BTRFS_MIRRORS 8  /* FSDETECT_BTRFS_MIRRORS. */
+#define BATCH_DIRECT 16  /* O_DIRECT with direct_read_block. */
+#define BATCH_QCOW2 32  /* Internal: the item is a qcow2 image. */
+
+/* Partitions after this many in a partition table are ignored. */
+#define BATCH_MAX_PARTITIONS 128
+
+struct batch_item {
+  const char *path;
+  struct fsdetect_output fsdo;
+  struct fsdetect_stats *stats;  /* Can be NULL. Filled with per-probe stats. */
+  /* With BATCH_PARTITIONS, the malloc()ed partitions, otherwise NULL. If
+   * NULL, fsdo is for the whole device.
+   */
+  struct fsdetect_partition *parts;
+  uint32_t part_count;
+  /* Can be NULL. If its key and fingerprint match, the cached fsdo is used,
+   * otherwise it's updated after a full detection.
+   */
+  struct rcache_entry *cache_entry;
+  /* Can be NULL. Filled if fsdo is Btrfs (not with partitions or the
+   * result cache).
+   */
+  struct fsdetect_btrfs_info *btrfs_info;
+  char is_open_failed;  /* fsdo is "?" because path couldn't be opened. */
+  char is_done;  /* Guarded by the mutex of the batch. */
+};
+
+struct batch;
+
+/* clock_ns_t callback using CLOCK_MONOTONIC. */
+uint64_t monotonic_ns(void);
+
+/* Starts detecting the filesystem in each item on thread_count worker
+ * threads (or in batch_wait_item if thread_count <= 1). Items with is_done
+ * set (e.g. by uring_run) are skipped. flags is a combination of BATCH_*
+ * constants. Returns NULL on error.
+ */
+struct batch *batch_start(struct batch_item *items, uint32_t item_count,
+                          uint32_t thread_count, uint32_t flags);
+/* Waits until items[item_idx] is done. */
+void batch_wait_item(struct batch *batch, uint32_t item_idx);
+/* Makes the worker threads stop after their current item. */
+void batch_cancel(struct batch *batch);
+/* Waits for the worker threads to exit, and frees batch. */
+void batch_finish(struct batch *batch);
+
+/* A filesystem found by scan_run. */
+struct scan_result {
+  uint64_t start_block;
+  struct fsdetect_output fsdo;
+};
+
+#define SCAN_MAX_THREADS 256
+
+/* Finds filesystems at any 512-byte-aligned offset in the image or device
+ * at path, using thread_count worker threads. Returns a malloc()ed array
+ * of the filesystems found, ordered by start_block, or NULL on error.
+ */
+struct scan_result *scan_run(const char *path, uint32_t thread_count,
+                             uint32_t *result_count_out);
+
+#ifdef HAVE_DAEMON
+/* Emits an output line (with the trailing newline) for path. */
+typedef char *(*emit_result_t)(char *p, const char *path,
+                               const struct fsdetect_output *fsdo);
+
+/* Runs the daemon on the Unix domain socket socket_path, answering queries
+ * about block devices and regular files in dirs. flags are for batch_start,
+ * without BATCH_PARTITIONS. Returns only on error.
+ */
+int daemon_run(const char *socket_path, char **dirs, uint32_t dir_count,
+               uint32_t thread_count, uint32_t flags,
+               emit_result_t emit_result);
+/* Asks the daemon about paths, and copies the answers to stdout. Returns
+ * the exit code.
+ */
+int daemon_query(const char *socket_path, char **paths, uint32_t path_count);
+#endif
+
+#ifdef HAVE_URING
+/* Detects the filesystem in each item using io_uring, with up to
+ * queue_depth reads in flight. Of the flags of batch_start, only
+ * BATCH_VERIFY_CSUM and BATCH_BTRFS_MIRRORS are supported. qcow2 images
+ * are left with is_done == 0, for batch_start. Returns nonzero if io_uring
+ * is not available.
+ */
+int uring_run(struct batch_item *items, uint32_t item_count,
+              uint32_t queue_depth, uint32_t flags);
+#endif
+#endif
+
+#endif  /* _FSDETECT_TOOL_H */
@@ -0,0 +1,391 @@
+/* Asynchronous batch engine on Linux io_uring.
+ *
+ * The probes are blocking, so each device is detected in passes: a pass
+ * runs fsdetect_ex with uring_read_block, which serves blocks already read,
+ * and records the blocks not read yet as new extents (and fails the read).
+ * When all extents of a pass have been read, the next pass runs. A pass
+ * which doesn't need new extents produces the final output, which is the
+ * same as what fsdetect would produce with blocking reads. Typically the
+ * first pass needs the fixed blocks of all probes (0, 2 and 128), and only
+ * NTFS and FAT32 need more passes for their dependent reads.
+ */
+
+#include "fsdetect_tool.h"
+#ifdef HAVE_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Per-device limits. Typical NTFS needs 3 + 2 * 8 blocks in 5 extents, the
+ * arena grows from URING_ARENA_SIZE for larger MFT records.
+ */
+#define URING_ARENA_SIZE 16384
+#define URING_ARENA_MAX_SIZE (2 * FSDETECT_SCRATCH_SIZE)
+#define URING_MAX_EXTENTS 8
+#define URING_MAX_PASSES 8
+
+#define EXTENT_NEW 0  /* Needed by the last pass, not submitted yet. */
+#define EXTENT_PENDING 1  /* Submitted. */
+#define EXTENT_OK 2
+#define EXTENT_FAILED 3
+
+struct uring_device;
+
+struct uring_extent {
+  uint64_t block_idx;
+  uint32_t block_count;
+  uint32_t arena_ofs;
+  struct iovec iov;  /* Must stay valid until completion. */
+  struct uring_device *dev;
+  char state;
+};
+
+struct uring_device {
+  struct batch_item *item;
+  int fd;
+  uint32_t extent_count;
+  uint32_t arena_used;
+  uint32_t arena_size;
+  uint32_t pending_count;  /* Number of queued or EXTENT_PENDING extents. */
+  uint32_t pass_count;
+  char has_new_extents;
+  char is_overflow;  /* A read didn't fit in the arena or the extents. */
+  struct uring_extent extents[URING_MAX_EXTENTS];
+  unsigned char *arena;  /* malloc()ed, kept when the device is reused. */
+};
+
+struct uring {
+  int fd;
+  uint32_t entry_count;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+static int uring_init(struct uring *ring, uint32_t entry_count) {
+  struct io_uring_params p;
+  memset(ring, '\0', sizeof(*ring));
+  memset(&p, '\0', sizeof(p));
+  if ((ring->fd = syscall(__NR_io_uring_setup, entry_count, &p)) < 0) return -1;
+  ring->entry_count = p.sq_entries;
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = (struct io_uring_sqe*)mmap(
+      0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      (void*)ring->sqes == MAP_FAILED) {
+    close(ring->fd);  /* The successful mappings are freed at exit. */
+    return -1;
+  }
+  ring->sq_head = (unsigned*)((char*)ring->sq_ring + p.sq_off.head);
+  ring->sq_tail = (unsigned*)((char*)ring->sq_ring + p.sq_off.tail);
+  ring->sq_mask = (unsigned*)((char*)ring->sq_ring + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)((char*)ring->sq_ring + p.sq_off.array);
+  ring->cq_head = (unsigned*)((char*)ring->cq_ring + p.cq_off.head);
+  ring->cq_tail = (unsigned*)((char*)ring->cq_ring + p.cq_off.tail);
+  ring->cq_mask = (unsigned*)((char*)ring->cq_ring + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + p.cq_off.cqes);
+  return 0;
+}
+
+static void uring_done(struct uring *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+/* Makes room for size more bytes in the arena. Only called during a pass,
+ * when no reads of dev are in flight. Returns nonzero if it's too large.
+ */
+static int grow_arena(struct uring_device *dev, uint32_t size) {
+  unsigned char *arena;
+  uint32_t i, arena_size = dev->arena_size ? dev->arena_size :
+      URING_ARENA_SIZE;
+  if (size > URING_ARENA_MAX_SIZE - dev->arena_used) return -1;
+  while (arena_size < dev->arena_used + size) arena_size <<= 1;
+  if (arena_size > URING_ARENA_MAX_SIZE) arena_size = URING_ARENA_MAX_SIZE;
+  if (!(arena = (unsigned char*)realloc(dev->arena, arena_size))) return -1;
+  dev->arena = arena;
+  dev->arena_size = arena_size;
+  for (i = 0; i < dev->extent_count; ++i) {
+    dev->extents[i].iov.iov_base = arena + dev->extents[i].arena_ofs;
+  }
+  return 0;
+}
+
+/* read_block_t callback of the passes. */
+static int uring_read_block(void *dev_ptr, uint64_t block_idx,
+                            uint32_t block_count, void *buf) {
+  struct uring_device *dev = (struct uring_device*)dev_ptr;
+  struct uring_extent *ext = dev->extents, *ext_end = ext + dev->extent_count;
+  const uint32_t size = block_count << 9;
+  for (; ext != ext_end; ++ext) {
+    if (ext->block_idx <= block_idx &&
+        block_idx + block_count <= ext->block_idx + ext->block_count) {
+      if (ext->state != EXTENT_OK) break;
+      memcpy(buf, (char*)ext->iov.iov_base +
+             ((block_idx - ext->block_idx) << 9), size);
+      return 0;
+    }
+  }
+  if (ext == ext_end && (dev->extent_count == URING_MAX_EXTENTS ||
+                         (size > dev->arena_size - dev->arena_used &&
+                          grow_arena(dev, size) != 0))) {
+    dev->is_overflow = 1;
+  } else if (ext == ext_end) {
+    ext->block_idx = block_idx;
+    ext->block_count = block_count;
+    ext->arena_ofs = dev->arena_used;
+    ext->iov.iov_base = dev->arena + dev->arena_used;
+    ext->iov.iov_len = size;
+    ext->dev = dev;
+    ext->state = EXTENT_NEW;
+    dev->arena_used += size;
+    ++dev->extent_count;
+    dev->has_new_extents = 1;
+  }
+  /* Fail it just like fsdetect_fd_read_block would. If there was no room
+   * to record it, the device goes to the batch threads.
+   */
+  memset(buf, '\0', size);
+  return -1;
+}
+
+struct uring_engine {
+  struct uring ring;
+  uint32_t pending_count;  /* Number of submitted, not completed reads. */
+  uint32_t unsubmitted_count;  /* Number of SQEs not seen by the kernel. */
+  /* FIFO of EXTENT_NEW extents waiting for SQ space. */
+  struct uring_extent **queue;
+  uint32_t queue_capacity, queue_head, queue_size;
+  struct uring_device **free_devs;
+  uint32_t free_dev_count;
+  uint32_t fsdetect_flags;  /* fsdetect_args.flags. */
+  /* For the probes. The passes run one at a time, so they can share it. */
+  void *scratch;
+  char is_failed;  /* io_uring_enter has failed, no more passes. */
+};
+
+/* With is_done == 0, leaves the item to the batch threads. */
+static void finish_device(struct uring_engine *engine,
+                          struct uring_device *dev, char is_done) {
+  if (dev->fd >= 0) close(dev->fd);
+  dev->item->is_done = is_done;
+  dev->item = 0;
+  engine->free_devs[engine->free_dev_count++] = dev;
+}
+
+#ifdef HAVE_QCOW2
+/* Returns nonzero if block 0 (read by the first pass) has the qcow2 magic. */
+static char is_qcow2(const struct uring_device *dev) {
+  const struct uring_extent *ext = dev->extents;
+  const struct uring_extent *ext_end = ext + dev->extent_count;
+  for (; ext != ext_end; ++ext) {
+    if (ext->block_idx == 0 && ext->state == EXTENT_OK) {
+      return 0 == memcmp(ext->iov.iov_base, "QFI\xfb", 4);
+    }
+  }
+  return 0;
+}
+#endif
+
+/* Runs a pass of fsdetect_ex on dev, and queues the new extents. */
+static void run_pass(struct uring_engine *engine, struct uring_device *dev) {
+  struct fsdetect_args args;
+  uint32_t i;
+  memset(&args, '\0', sizeof(args));
+  args.read_block64 = uring_read_block;
+  args.read_block_data = dev;
+  args.stats = dev->item->stats;  /* Of the last pass, no I/O wait. */
+  args.clock_ns = monotonic_ns;
+  args.flags = engine->fsdetect_flags;
+  args.btrfs_info = dev->item->btrfs_info;
+  args.scratch = engine->scratch;  /* Can be NULL. */
+  args.scratch_size = FSDETECT_SCRATCH_SIZE;
+  dev->has_new_extents = dev->is_overflow = 0;
+  fsdetect_ex(&args, &dev->item->fsdo);
+  /* The threads do the devices which need more reads than the engine can
+   * record, and qcow2 images (through their cluster tables).
+   */
+  if (dev->is_overflow || (dev->has_new_extents &&
+                           ++dev->pass_count == URING_MAX_PASSES)) {
+    finish_device(engine, dev, 0);
+    return;
+  }
+  if (!dev->has_new_extents) {
+#ifdef HAVE_QCOW2
+    finish_device(engine, dev, !is_qcow2(dev));
+#else
+    finish_device(engine, dev, 1);
+#endif
+    return;
+  }
+  for (i = 0; i < dev->extent_count; ++i) {
+    if (dev->extents[i].state == EXTENT_NEW) {
+      engine->queue[(engine->queue_head + engine->queue_size++) %
+                    engine->queue_capacity] = dev->extents + i;
+      ++dev->pending_count;
+    }
+  }
+}
+
+static void start_device(struct uring_engine *engine,
+                         struct batch_item *item) {
+  struct uring_device *dev = engine->free_devs[--engine->free_dev_count];
+  dev->item = item;
+  dev->extent_count = dev->arena_used = dev->pending_count = 0;
+  dev->pass_count = 0;
+  if ((item->is_open_failed = (dev->fd = open(item->path, O_RDONLY)) < 0)) {
+    memset(&item->fsdo, '\0', sizeof(item->fsdo));
+    item->fsdo.fstype[0] = '?';
+    finish_device(engine, dev, 1);
+    return;
+  }
+  run_pass(engine, dev);
+}
+
+/* Moves queued extents to the SQ ring, while there is room. */
+static void fill_sq(struct uring_engine *engine) {
+  struct uring *ring = &engine->ring;
+  unsigned tail = *ring->sq_tail;
+  const unsigned mask = *ring->sq_mask;
+  while (engine->queue_size > 0 &&
+         engine->pending_count < ring->entry_count &&
+         tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) <
+         ring->entry_count) {
+    struct uring_extent *ext = engine->queue[engine->queue_head];
+    struct io_uring_sqe *sqe = ring->sqes + (tail & mask);
+    engine->queue_head = (engine->queue_head + 1) % engine->queue_capacity;
+    --engine->queue_size;
+    memset(sqe, '\0', sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = ext->dev->fd;
+    sqe->addr = (uint64_t)(size_t)&ext->iov;
+    sqe->len = 1;
+    sqe->off = ext->block_idx << 9;
+    sqe->user_data = (uint64_t)(size_t)ext;
+    ring->sq_array[tail & mask] = tail & mask;
+    ++tail;
+    ext->state = EXTENT_PENDING;
+    ++engine->pending_count;
+    ++engine->unsubmitted_count;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Processes all available completions. */
+static void reap_cq(struct uring_engine *engine) {
+  struct uring *ring = &engine->ring;
+  unsigned head = *ring->cq_head;
+  const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+    struct uring_extent *ext = (struct uring_extent*)(size_t)cqe->user_data;
+    struct uring_device *dev = ext->dev;
+    ext->state = (size_t)cqe->res == ext->iov.iov_len ? EXTENT_OK
+               : EXTENT_FAILED;
+    --engine->pending_count;
+    if (--dev->pending_count == 0 && !engine->is_failed) run_pass(engine, dev);
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+int uring_run(struct batch_item *items, uint32_t item_count,
+              uint32_t queue_depth, uint32_t flags) {
+  struct uring_engine engine;
+  struct uring_device *devs;
+  uint32_t i, dev_count, next_item_idx = 0;
+  int got;
+  if (queue_depth == 0) queue_depth = 1;
+  if (uring_init(&engine.ring, queue_depth) != 0) return -1;
+  engine.fsdetect_flags =
+      (flags & BATCH_VERIFY_CSUM ? FSDETECT_VERIFY_CSUM : 0) |
+      (flags & BATCH_BTRFS_MIRRORS ? FSDETECT_BTRFS_MIRRORS : 0);
+  /* Each device usually has 1 to 3 reads in flight. */
+  dev_count = engine.ring.entry_count;
+  if (dev_count > item_count) dev_count = item_count + !item_count;
+  engine.queue_capacity = dev_count * URING_MAX_EXTENTS;
+  engine.queue = (struct uring_extent**)malloc(
+      engine.queue_capacity * sizeof(*engine.queue));
+  engine.free_devs = (struct uring_device**)malloc(
+      dev_count * sizeof(*engine.free_devs));
+  devs = (struct uring_device*)malloc(dev_count * sizeof(*devs));
+  if (!engine.queue || !engine.free_devs || !devs) {
+    uring_done(&engine.ring);
+    return -1;
+  }
+  for (i = 0; i < dev_count; ++i) {
+    engine.free_devs[i] = devs + i;
+    devs[i].item = 0;
+    devs[i].arena = 0;
+    devs[i].arena_size = 0;
+  }
+  engine.scratch = malloc(FSDETECT_SCRATCH_SIZE);
+  engine.free_dev_count = dev_count;
+  engine.pending_count = engine.unsubmitted_count = 0;
+  engine.is_failed = 0;
+  engine.queue_head = engine.queue_size = 0;
+  for (i = 0; i < item_count; ++i) {
+    items[i].is_done = 0;
+  }
+  for (;;) {
+    while (engine.free_dev_count > 0 && next_item_idx < item_count) {
+      start_device(&engine, items + next_item_idx++);
+    }
+    fill_sq(&engine);
+    if (engine.pending_count == 0) {
+      if (engine.queue_size == 0 && next_item_idx == item_count) break;
+      continue;
+    }
+    got = syscall(__NR_io_uring_enter, engine.ring.fd,
+                  engine.unsubmitted_count, 1, IORING_ENTER_GETEVENTS,
+                  (void*)0, 0);
+    if (got >= 0) {
+      engine.unsubmitted_count -= got;
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      engine.is_failed = 1;  /* Shouldn't happen. */
+      break;
+    }
+    reap_cq(&engine);
+  }
+  if (engine.is_failed) {
+    /* The kernel may still write to the arenas: wait for the reads it has
+     * seen (the SQEs not submitted are dropped with the ring). If even
+     * that fails, the arenas and the ring are leaked.
+     */
+    while (engine.pending_count > engine.unsubmitted_count) {
+      if (syscall(__NR_io_uring_enter, engine.ring.fd, 0, 1,
+                  IORING_ENTER_GETEVENTS, (void*)0, 0) < 0 &&
+          errno != EINTR && errno != EAGAIN && errno != EBUSY) break;
+      reap_cq(&engine);
+    }
+    /* The threads do the unfinished items. */
+    for (i = 0; i < dev_count; ++i) {
+      if (devs[i].item) finish_device(&engine, devs + i, 0);
+    }
+    if (engine.pending_count > engine.unsubmitted_count) return 0;
+  }
+  for (i = 0; i < dev_count; ++i) {
+    free(devs[i].arena);
+  }
+  free(engine.scratch);
+  free(devs);
+  free(engine.free_devs);
+  free(engine.queue);
+  uring_done(&engine.ring);
+  return 0;
+}
+#endif